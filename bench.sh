@@ -0,0 +1,202 @@
+#!/bin/sh
+# usage: bench.sh [runs] [scale] [aa] [size factor]
+runs=${1:-5}
+scale=${2:-1}
+aa=${3:-4}
+factor=${4:-1}
+crop=${CROP:-400,400,100,100}
+curves=${CURVES:-1000000}
+big=${BIG:-8}
+dir=${BENCH_DIR:-bench}
+
+mkdir -p "$dir"
+printf "%-9s %-9s %10s %7s %14s %7s\n" scene stage "wall ms" "+-%" throughput "+-%"
+
+# Both flatteners on the same random curves, with nothing else in the run.
+log="$dir/curves.log"
+: > "$log"
+i=0
+while [ $i -lt "$runs" ]; do
+  ./interpret --stats --curves "$curves" "$scale" 2>> "$log"
+  ./interpret --stats --curves "$curves" --batch "$scale" 2>> "$log"
+  i=$((i + 1))
+done
+awk '
+  function dev(s, q, k,   m, v) {
+    m = s / k
+    v = q / k - m * m
+    return m > 0 && v > 0 ? 100 * sqrt(v) / m : 0
+  }
+  /"tool":"interpret"/ {
+    match($0, /"flatten":\{"wall":[0-9.]+/)
+    t = substr($0, RSTART + 19, RLENGTH - 19)
+    match($0, /"curves":[0-9]+/)
+    rate = substr($0, RSTART + 9, RLENGTH - 9) / t / 1e6
+    s = (batch = !batch) ? "flatten" : "batch"
+    n[s]++
+    sum[s] += t
+    sq[s] += t * t
+    rsum[s] += rate
+    rsq[s] += rate * rate
+  }
+  END {
+    split("flatten batch", stages, " ")
+    for (i = 1; i <= 2; ++i) {
+      s = stages[i]
+      printf "%-9s %-9s %10.2f %7.1f %8.2f %-5s %7.1f\n", "curves", s,
+             1e3 * sum[s] / n[s], dev(sum[s], sq[s], n[s]),
+             rsum[s] / n[s], "Mc/s", dev(rsum[s], rsq[s], n[s])
+    }
+  }' "$log"
+
+# Thread scaling on the tiger at a large scale (BIG, default 8): interpret,
+# whose paths there are mostly curves, and rasterize, whose output rows the
+# threads split. Rates are per second of elapsed time, so they only grow with
+# -j on a machine with the cores for it.
+./compile < test/tiger.svg > "$dir/tiger.cmd"
+./interpret "$big" < "$dir/tiger.cmd" > "$dir/tiger.poly"
+log="$dir/threads.log"
+: > "$log"
+i=0
+while [ $i -lt "$runs" ]; do
+  for j in 1 2 4; do
+    ./interpret --stats -j $j "$big" < "$dir/tiger.cmd" 2>> "$log" > /dev/null
+    ./rasterize --stats -j $j "$big" "$aa" < "$dir/tiger.poly" 2>> "$log" \
+      > /dev/null
+  done
+  i=$((i + 1))
+done
+awk '
+  function dev(s, q, k,   m, v) {
+    m = s / k
+    v = q / k - m * m
+    return m > 0 && v > 0 ? 100 * sqrt(v) / m : 0
+  }
+  function add(s, t, rate) {
+    n[s]++
+    sum[s] += t
+    sq[s] += t * t
+    rsum[s] += rate
+    rsq[s] += rate * rate
+  }
+  {
+    match($0, /"elapsed":[0-9.]+/)
+    t = substr($0, RSTART + 10, RLENGTH - 10)
+  }
+  /"tool":"interpret"/ {
+    match($0, /"curves":[0-9]+/)
+    rate = substr($0, RSTART + 9, RLENGTH - 9) / t / 1e3
+    add("interp/" 2 ^ (k % 3), t, rate)
+  }
+  /"tool":"rasterize"/ {
+    match($0, /"pixels":[0-9]+/)
+    rate = substr($0, RSTART + 9, RLENGTH - 9) / t / 1e6
+    add("raster/" 2 ^ (k++ % 3), t, rate)
+  }
+  END {
+    split("kc/s Mpix/s", units, " ")
+    for (i = 0; i < 6; ++i) {
+      s = (i < 3 ? "interp/" : "raster/") 2 ^ (i % 3)
+      printf "%-9s %-9s %10.2f %7.1f %8.2f %-5s %7.1f\n", "tiger", s,
+             1e3 * sum[s] / n[s], dev(sum[s], sq[s], n[s]),
+             rsum[s] / n[s], units[i < 3 ? 1 : 2], dev(rsum[s], rsq[s], n[s])
+    }
+  }' "$log"
+
+for scene in $(./gen); do
+  svg="$dir/$scene.svg"
+  ./gen "$scene" "$factor" > "$svg"
+  ./compile < "$svg" > "$dir/$scene.cmd"
+  ./interpret "$scale" < "$dir/$scene.cmd" > "$dir/$scene.poly"
+  bytes=$(wc -c < "$svg")
+
+  log="$dir/$scene.log"
+  : > "$log"
+  i=0
+  while [ $i -lt "$runs" ]; do
+    ./compile --stats < "$svg" 2>> "$log" > /dev/null
+    ./interpret --stats --batch "$scale" < "$dir/$scene.cmd" 2>> "$log" > /dev/null
+    ./interpret --stats "$scale" < "$dir/$scene.cmd" 2>> "$log" > /dev/null
+    ./rasterize --stats "$scale" "$aa" < "$dir/$scene.poly" 2>> "$log" > /dev/null
+    ./rasterize --stats --fixed "$scale" "$aa" < "$dir/$scene.poly" 2>> "$log" > /dev/null
+    ./rasterize --stats --crop "$crop" "$scale" "$aa" < "$dir/$scene.poly" 2>> "$log" > /dev/null
+    ./rasterize --stats --index --crop "$crop" "$scale" "$aa" < "$dir/$scene.poly" 2>> "$log" > /dev/null
+    ./rasterize --stats --preview "$dir/$scene.preview.bmp" "$scale" "$aa" < "$dir/$scene.poly" 2>> "$log" > /dev/null
+    i=$((i + 1))
+  done
+
+  awk -v scene="$scene" -v bytes="$bytes" '
+    function field(name,   s) {
+      if (!match($0, "\"" name "\":[0-9.]+")) return 0
+      s = substr($0, RSTART, RLENGTH)
+      sub(/.*:/, "", s)
+      return s + 0
+    }
+    function phase(name,   s) {
+      if (!match($0, "\"" name "\":\\{\"wall\":[0-9.]+")) return 0
+      s = substr($0, RSTART, RLENGTH)
+      sub(/.*:/, "", s)
+      return s + 0
+    }
+    function wall(   s, t) {
+      s = $0
+      t = 0
+      while (match(s, /"wall":[0-9.]+/)) {
+        t += substr(s, RSTART + 7, RLENGTH - 7)
+        s = substr(s, RSTART + RLENGTH)
+      }
+      return t
+    }
+    function add(stage, t, rate) {
+      n[stage]++
+      sum[stage] += t
+      sq[stage] += t * t
+      rsum[stage] += rate
+      rsq[stage] += rate * rate
+    }
+    function dev(s, q, k,   m, v) {
+      m = s / k
+      v = q / k - m * m
+      return m > 0 && v > 0 ? 100 * sqrt(v) / m : 0
+    }
+    /"tool":"compile"/ { t = wall(); add("compile", t, bytes / t / 1e6) }
+    /"tool":"interpret"/ {
+      f = phase("flatten")
+      if (batch = !batch) {
+        add("batch", f, f > 0 ? field("curves") / f / 1e6 : 0)
+      } else {
+        add("flatten", f, f > 0 ? field("curves") / f / 1e6 : 0)
+        pending = wall()
+      }
+    }
+    /"tool":"rasterize"/ {
+      t = wall()
+      run = run % 5 + 1
+      if (run == 1) {
+        add("interpret", pending, field("polygons") / pending)
+        add("rasterize", t, field("pixels") / t / 1e6)
+      } else if (run == 2) {
+        add("fixed", t, field("pixels") / t / 1e6)
+      } else if (run == 5) {
+        t = field("first_image")
+        add("preview", t, t > 0 ? 1 / t : 0)
+      } else {
+        # Crops are timed without parsing, which reads the whole stream
+        # either way; the rate is in polygons rasterized.
+        t -= phase("read")
+        add(run == 3 ? "crop" : "indexed", t, field("polygons") / t)
+      }
+    }
+    END {
+      split("compile interpret flatten batch rasterize fixed crop indexed " \
+            "preview", stages, " ")
+      split("MB/s poly/s Mc/s Mc/s Mpix/s Mpix/s poly/s poly/s img/s",
+            units, " ")
+      for (i = 1; i <= 9; ++i) {
+        s = stages[i]
+        printf "%-9s %-9s %10.2f %7.1f %8.2f %-5s %7.1f\n", scene, s,
+               1e3 * sum[s] / n[s], dev(sum[s], sq[s], n[s]),
+               rsum[s] / n[s], units[i], dev(rsum[s], rsq[s], n[s])
+      }
+    }' "$log"
+done
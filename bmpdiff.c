@@ -0,0 +1,134 @@
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+typedef struct image {
+  int w, h;
+  unsigned char *header;
+  int header_size;
+  unsigned char *pixels;
+} image;
+
+static uint32_t u32(unsigned char *p) {
+  return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static int read_bmp(const char *filename, image *img) {
+  FILE *f = fopen(filename, "rb");
+  if (!f) return 0;
+
+  unsigned char file_header[14];
+  if (fread(file_header, 1, 14, f) != 14 || file_header[0] != 'B' ||
+      file_header[1] != 'M') {
+    fclose(f);
+    return 0;
+  }
+
+  img->header_size = u32(file_header + 10);
+  img->header = malloc(img->header_size);
+  memcpy(img->header, file_header, 14);
+  size_t rest = img->header_size - 14;
+  if (fread(img->header + 14, 1, rest, f) != rest) {
+    fclose(f);
+    return 0;
+  }
+
+  int bit_count = img->header[28] | img->header[29] << 8;
+  img->w = (int32_t)u32(img->header + 18);
+  img->h = (int32_t)u32(img->header + 22);
+  if (img->h < 0) img->h = -img->h;
+  if (bit_count != 32) {
+    fclose(f);
+    return 0;
+  }
+
+  size_t n = (size_t)img->w * img->h * 4;
+  img->pixels = malloc(n);
+  int ok = fread(img->pixels, 1, n, f) == n;
+  fclose(f);
+  return ok;
+}
+
+static int difference(unsigned char *p, unsigned char *q) {
+  int diff = abs(p[3] - q[3]);
+  for (int c = 0; c < 3; ++c) {
+    int d = abs(p[c] * p[3] - q[c] * q[3]) / 255;
+    if (d > diff) diff = d;
+  }
+  return diff;
+}
+
+static void write_bmp(image *img, const char *filename) {
+  FILE *f = fopen(filename, "wb");
+  if (!f) return;
+  fwrite(img->header, 1, img->header_size, f);
+  fwrite(img->pixels, 4, (size_t)img->w * img->h, f);
+  fclose(f);
+}
+
+int main(int argc, char *argv[]) {
+  if (argc < 3) {
+    fprintf(stderr,
+            "usage: bmpdiff ref.bmp out.bmp [diff.bmp] [tolerance] "
+            "[max bad fraction] [min psnr]\n");
+    return 2;
+  }
+
+  int tolerance = 2;
+  float max_bad = 0.001f, min_psnr = 40.0f;
+  if (argc >= 5) sscanf(argv[4], "%d", &tolerance);
+  if (argc >= 6) sscanf(argv[5], "%f", &max_bad);
+  if (argc >= 7) sscanf(argv[6], "%f", &min_psnr);
+
+  image ref, out;
+  if (!read_bmp(argv[1], &ref)) {
+    fprintf(stderr, "bmpdiff: cannot read %s\n", argv[1]);
+    return 2;
+  }
+  if (!read_bmp(argv[2], &out)) {
+    fprintf(stderr, "bmpdiff: cannot read %s\n", argv[2]);
+    return 2;
+  }
+  if (ref.w != out.w || ref.h != out.h) {
+    printf("%s: size %dx%d, expected %dx%d\n", argv[2], out.w, out.h, ref.w,
+           ref.h);
+    return 1;
+  }
+
+  int n = ref.w * ref.h, bad = 0, max_diff = 0;
+  double squared = 0;
+  for (int i = 0; i < n; ++i) {
+    int diff = difference(&ref.pixels[i * 4], &out.pixels[i * 4]);
+    squared += diff * diff;
+    if (diff > max_diff) max_diff = diff;
+    if (diff > tolerance) ++bad;
+  }
+
+  double mse = squared / n;
+  double psnr = mse > 0 ? 10 * log10(255.0 * 255.0 / mse) : INFINITY;
+  int failed = bad > max_bad * n || psnr < min_psnr;
+
+  printf("%s: %s max %d, %d pixels over %d (%.4f%%), psnr %.2f dB\n", argv[2],
+         failed ? "FAIL" : "ok", max_diff, bad, tolerance, 100.0 * bad / n,
+         psnr);
+
+  if (failed && argc >= 4) {
+    for (int i = 0; i < n; ++i) {
+      unsigned char *p = &out.pixels[i * 4], *q = &ref.pixels[i * 4];
+      int diff = difference(p, q);
+      if (diff > tolerance) {
+        p[0] = 0;
+        p[1] = 0;
+        p[2] = 128 + diff / 2;
+      } else {
+        int l = (q[0] + q[1] + q[2]) * q[3] / (12 * 255);
+        p[0] = p[1] = p[2] = l;
+      }
+      p[3] = 0xff;
+    }
+    write_bmp(&out, argv[3]);
+  }
+  return failed;
+}
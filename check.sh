@@ -0,0 +1,92 @@
+#!/bin/sh
+# usage: check.sh [refs]
+# Renders the corpus at several scale/aa settings and compares each image
+# with test/ref. With "refs", writes the references instead.
+mode=${1:-check}
+ref=test/ref
+out=test/out
+corpus=test/corpus
+settings="1,1 1,4 2,2"
+
+# The references are committed, so documents are drawn on a reduced canvas.
+canvas() { sed '1s/<svg /<svg width="300" /'; }
+
+mkdir -p "$ref" "$out" "$corpus"
+canvas < test/tiger.svg > "$corpus/tiger.svg"
+for scene in small:0.05 huge:0.25 nested:0.2 strokes:0.2 overdraw:0.1 long:0.05 shapes:0.1 symbols:0.2 clips:0.1 opacity:0.1; do
+  ./gen "${scene%:*}" "${scene#*:}" | canvas > "$corpus/${scene%:*}.svg"
+done
+
+failed=0
+for svg in "$corpus"/*.svg; do
+  name=$(basename "$svg" .svg)
+  for setting in $settings; do
+    scale=${setting%,*}
+    aa=${setting#*,}
+    bmp="$name-$scale-$aa.bmp"
+
+    if [ "$mode" = refs ]; then
+      ./compile < "$svg" | ./interpret "$scale" | ./rasterize "$scale" "$aa" > "$ref/$bmp"
+      echo "$ref/$bmp"
+      continue
+    fi
+
+    ./compile < "$svg" | ./interpret "$scale" | ./rasterize "$scale" "$aa" > "$out/$bmp"
+    ./svg "$scale" "$aa" < "$svg" > "$out/svg-$bmp"
+    ./compile < "$svg" | ./interpret --batch "$scale" |
+      ./rasterize "$scale" "$aa" > "$out/batch-$bmp"
+    for img in "$bmp" "svg-$bmp" "batch-$bmp"; do
+      if ! ./bmpdiff "$ref/$bmp" "$out/$img" "$out/${img%.bmp}.diff.bmp"; then
+        failed=1
+      fi
+    done
+
+    # The fixed-point engine steps edges exactly, so it drifts from the float
+    # reference on tall, nearly horizontal edges.
+    ./svg --fixed "$scale" "$aa" < "$svg" > "$out/fixed-$bmp"
+    if ! ./bmpdiff "$ref/$bmp" "$out/fixed-$bmp" "$out/fixed-$name-$scale-$aa.diff.bmp" 2 0.01 40; then
+      failed=1
+    fi
+  done
+done
+
+# Clip and layer boundaries go through the paint queue already done; long
+# runs of them must not let workers claim slots the writer has reused.
+if [ "$mode" != refs ]; then
+  ./gen runs | ./compile > "$out/runs.cmd"
+  ./interpret < "$out/runs.cmd" > "$out/runs.poly"
+  for run in 1 2 3 4 5 6 7 8 9 10; do
+    for j in 2 4; do
+      if ! ./interpret -j $j < "$out/runs.cmd" | cmp -s - "$out/runs.poly"
+      then
+        echo "interpret -j $j: runs differs from one thread"
+        failed=1
+      fi
+    done
+  done
+fi
+
+# --preview writes a half-scale frame to its own file and leaves stdout as
+# it was.
+if [ "$mode" != refs ]; then
+  ./compile < "$corpus/tiger.svg" | ./interpret 2 |
+    ./rasterize --preview "$out/preview-tiger.bmp" 2 2 > "$out/full-tiger.bmp"
+  if ! cmp -s "$out/full-tiger.bmp" "$out/tiger-2-2.bmp"; then
+    echo "rasterize --preview: full image differs"
+    failed=1
+  fi
+  if ! ./bmpdiff "$out/tiger-1-1.bmp" "$out/preview-tiger.bmp" "$out/preview-tiger.diff.bmp" 64 0.05 20; then
+    failed=1
+  fi
+fi
+
+# A served tile must match the same window cropped from a full run.
+if [ "$mode" != refs ]; then
+  ./svg --crop 128,128,128,128 2 < test/tiger.svg > "$out/crop-tiger.bmp"
+  printf 'tile 1 1 1\n' | ./svg --serve test/tiger.svg 2> /dev/null |
+    { read -r status; cat; } > "$out/tile-tiger.bmp"
+  if ! ./bmpdiff "$out/crop-tiger.bmp" "$out/tile-tiger.bmp" "$out/tile-tiger.diff.bmp" 0 0 99; then
+    failed=1
+  fi
+fi
+exit $failed
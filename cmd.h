@@ -21,4 +21,17 @@ typedef enum {
   s_curve_to_d,
   close_path,
   fill_and_stroke,
+  canvas,
+  rect,
+  circle,
+  ellipse,
+  define,
+  use,
+  begin_clip,
+  end_clip,
+  pop_clip,
+  fill_opacity,
+  stroke_opacity,
+  begin_layer,
+  end_layer,
 } cmd_type;
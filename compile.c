@@ -1,31 +1,234 @@
 #include <ctype.h>
+#include <math.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
 #include "cmd.h"
+#include "stats.h"
+#include "svg.h"
+
+typedef struct arena_block {
+  struct arena_block *next;
+  size_t size, used;
+  char data[];
+} arena_block;
+
+typedef struct arena {
+  arena_block *head;
+  arena_block *cur;
+} arena;
+
+static _Thread_local arena heap;
+
+static void *alloc(size_t n) {
+  n = (n + 7) & ~(size_t)7;
+  while (!heap.cur || heap.cur->used + n > heap.cur->size) {
+    arena_block *next = heap.cur ? heap.cur->next : heap.head;
+    if (!next || next->size < n) {
+      size_t size = n < 65536 ? 65536 : n;
+      arena_block *b = malloc(sizeof(arena_block) + size);
+      if (!b) exit(1);
+      b->size = size;
+      b->next = next;
+      if (heap.cur)
+        heap.cur->next = b;
+      else
+        heap.head = b;
+      next = b;
+    }
+    next->used = 0;
+    heap.cur = next;
+  }
+  void *p = heap.cur->data + heap.cur->used;
+  heap.cur->used += n;
+  return memset(p, 0, n);
+}
 
 typedef struct char_stream {
   int next;
+  FILE *in;
 } char_stream;
 
-int read_char(char_stream *s) {
+static int read_char(char_stream *s) {
   int c = s->next;
-  s->next = getchar();
+  s->next = getc(s->in);
   return c;
 }
 
-char *get_string(char_stream *s, char *end) {
-  static char buffer[4096];
-  int i = 0;
+static char *read_string(char_stream *s, char *end, size_t *n) {
+  static _Thread_local char *buffer;
+  static _Thread_local size_t capacity;
+  size_t i = 0;
   while (s->next != EOF && !(strchr(end, s->next))) {
+    if (i + 1 >= capacity) {
+      capacity = capacity ? 2 * capacity : 4096;
+      buffer = realloc(buffer, capacity);
+      if (!buffer) exit(1);
+    }
     buffer[i++] = read_char(s);
   }
 
   if (!(strchr(end, s->next))) exit(1);
 
-  buffer[i] = '\0';
-  return strdup(buffer);
+  *n = i;
+  return buffer;
+}
+
+static char *get_string(char_stream *s, char *end) {
+  size_t n;
+  char *buffer = read_string(s, end, &n);
+  char *str = alloc(n + 1);
+  memcpy(str, buffer, n);
+  return str;
+}
+
+typedef enum name {
+  name_unknown,
+  name_svg,
+  name_g,
+  name_path,
+  name_d,
+  name_fill,
+  name_stroke,
+  name_stroke_width,
+  name_transform,
+  name_width,
+  name_height,
+  name_view_box,
+  name_rect,
+  name_circle,
+  name_ellipse,
+  name_line,
+  name_polyline,
+  name_polygon,
+  name_x,
+  name_y,
+  name_rx,
+  name_ry,
+  name_cx,
+  name_cy,
+  name_r,
+  name_x1,
+  name_y1,
+  name_x2,
+  name_y2,
+  name_points,
+  name_defs,
+  name_symbol,
+  name_use,
+  name_id,
+  name_href,
+  name_xlink_href,
+  name_clip_path,
+  name_clip_path_attr,
+  name_opacity,
+  name_fill_opacity,
+  name_stroke_opacity,
+  n_names,
+} name;
+
+static const char *const name_strings[] = {
+    [name_svg] = "svg",
+    [name_g] = "g",
+    [name_path] = "path",
+    [name_d] = "d",
+    [name_fill] = "fill",
+    [name_stroke] = "stroke",
+    [name_stroke_width] = "stroke-width",
+    [name_transform] = "transform",
+    [name_width] = "width",
+    [name_height] = "height",
+    [name_view_box] = "viewBox",
+    [name_rect] = "rect",
+    [name_circle] = "circle",
+    [name_ellipse] = "ellipse",
+    [name_line] = "line",
+    [name_polyline] = "polyline",
+    [name_polygon] = "polygon",
+    [name_x] = "x",
+    [name_y] = "y",
+    [name_rx] = "rx",
+    [name_ry] = "ry",
+    [name_cx] = "cx",
+    [name_cy] = "cy",
+    [name_r] = "r",
+    [name_x1] = "x1",
+    [name_y1] = "y1",
+    [name_x2] = "x2",
+    [name_y2] = "y2",
+    [name_points] = "points",
+    [name_defs] = "defs",
+    [name_symbol] = "symbol",
+    [name_use] = "use",
+    [name_id] = "id",
+    [name_href] = "href",
+    [name_xlink_href] = "xlink:href",
+    [name_clip_path] = "clipPath",
+    [name_clip_path_attr] = "clip-path",
+    [name_opacity] = "opacity",
+    [name_fill_opacity] = "fill-opacity",
+    [name_stroke_opacity] = "stroke-opacity",
+};
+
+// A name hashes on its first and last characters and its length. The slots
+// below must stay distinct; with -Wextra a collision shows up as an
+// overridden initializer.
+#define NAME_SLOTS 256
+#define NAME_SLOT(first, last, n) \
+  ((4 * (first) + 9 * (last) + 2 * (n)) & (NAME_SLOTS - 1))
+
+static const name name_slots[NAME_SLOTS] = {
+    [NAME_SLOT('s', 'g', 3)] = name_svg,
+    [NAME_SLOT('g', 'g', 1)] = name_g,
+    [NAME_SLOT('p', 'h', 4)] = name_path,
+    [NAME_SLOT('d', 'd', 1)] = name_d,
+    [NAME_SLOT('f', 'l', 4)] = name_fill,
+    [NAME_SLOT('s', 'e', 6)] = name_stroke,
+    [NAME_SLOT('s', 'h', 12)] = name_stroke_width,
+    [NAME_SLOT('t', 'm', 9)] = name_transform,
+    [NAME_SLOT('w', 'h', 5)] = name_width,
+    [NAME_SLOT('h', 't', 6)] = name_height,
+    [NAME_SLOT('v', 'x', 7)] = name_view_box,
+    [NAME_SLOT('r', 't', 4)] = name_rect,
+    [NAME_SLOT('c', 'e', 6)] = name_circle,
+    [NAME_SLOT('e', 'e', 7)] = name_ellipse,
+    [NAME_SLOT('l', 'e', 4)] = name_line,
+    [NAME_SLOT('p', 'e', 8)] = name_polyline,
+    [NAME_SLOT('p', 'n', 7)] = name_polygon,
+    [NAME_SLOT('x', 'x', 1)] = name_x,
+    [NAME_SLOT('y', 'y', 1)] = name_y,
+    [NAME_SLOT('r', 'x', 2)] = name_rx,
+    [NAME_SLOT('r', 'y', 2)] = name_ry,
+    [NAME_SLOT('c', 'x', 2)] = name_cx,
+    [NAME_SLOT('c', 'y', 2)] = name_cy,
+    [NAME_SLOT('r', 'r', 1)] = name_r,
+    [NAME_SLOT('x', '1', 2)] = name_x1,
+    [NAME_SLOT('y', '1', 2)] = name_y1,
+    [NAME_SLOT('x', '2', 2)] = name_x2,
+    [NAME_SLOT('y', '2', 2)] = name_y2,
+    [NAME_SLOT('p', 's', 6)] = name_points,
+    [NAME_SLOT('d', 's', 4)] = name_defs,
+    [NAME_SLOT('s', 'l', 6)] = name_symbol,
+    [NAME_SLOT('u', 'e', 3)] = name_use,
+    [NAME_SLOT('i', 'd', 2)] = name_id,
+    [NAME_SLOT('h', 'f', 4)] = name_href,
+    [NAME_SLOT('x', 'f', 10)] = name_xlink_href,
+    [NAME_SLOT('c', 'h', 8)] = name_clip_path,
+    [NAME_SLOT('c', 'h', 9)] = name_clip_path_attr,
+    [NAME_SLOT('o', 'y', 7)] = name_opacity,
+    [NAME_SLOT('f', 'y', 12)] = name_fill_opacity,
+    [NAME_SLOT('s', 'y', 14)] = name_stroke_opacity,
+};
+
+static name intern(const char *s, size_t n) {
+  if (!n) return name_unknown;
+  unsigned char first = s[0], last = s[n - 1];
+  name id = name_slots[NAME_SLOT(first, last, n)];
+  const char *t = name_strings[id];
+  if (!id || strlen(t) != n || memcmp(t, s, n) != 0) return name_unknown;
+  return id;
 }
 
 typedef enum {
@@ -41,7 +244,10 @@ typedef enum {
 
 typedef struct token {
   token_type type;
-  char *str;
+  union {
+    char *str;
+    name id;
+  };
 } token;
 
 typedef struct token_stream {
@@ -49,7 +255,8 @@ typedef struct token_stream {
   char_stream src;
 } token_stream;
 
-token read_token(token_stream *s) {
+static token read_token(token_stream *s) {
+  enter_phase(phase_tokenize);
   token t = s->next;
   while (isspace(s->src.next)) read_char(&s->src);
 
@@ -93,15 +300,18 @@ token read_token(token_stream *s) {
       break;
     }
     default: {
-      char *str = get_string(&s->src, " =>");
-      s->next = (token){.type = string, .str = str};
+      size_t n;
+      char *str = read_string(&s->src, " =>", &n);
+      s->next = (token){.type = string, .id = intern(str, n)};
       break;
     }
   }
+  count(count_tokens, 1);
+  leave_phase();
   return t;
 }
 
-int accept(token_stream *s, token_type expected, token *dst) {
+static int accept(token_stream *s, token_type expected, token *dst) {
   if (s->next.type != expected) return 0;
   if (dst) *dst = s->next;
   read_token(s);
@@ -109,27 +319,30 @@ int accept(token_stream *s, token_type expected, token *dst) {
 }
 
 typedef struct attr_node {
-  token name;
-  token value;
+  name name;
+  char *value;
   struct attr_node *next;
 } attr_node;
 
 typedef struct xml_node {
-  token tag;
+  name tag;
   attr_node *attrs;
   struct xml_node *next;
   struct xml_node *children;
 } xml_node;
 
-attr_node *attr(token_stream *s) {
-  attr_node *node = calloc(1, sizeof(attr_node));
-  if (!(accept(s, string, &node->name) && accept(s, eq, NULL) &&
-        accept(s, quoted_string, &node->value)))
+static attr_node *attr(token_stream *s) {
+  attr_node *node = alloc(sizeof(attr_node));
+  token name, value;
+  if (!(accept(s, string, &name) && accept(s, eq, NULL) &&
+        accept(s, quoted_string, &value)))
     exit(1);
+  node->name = name.id;
+  node->value = value.str;
   return node;
 }
 
-attr_node *attr_list(token_stream *s) {
+static attr_node *attr_list(token_stream *s) {
   if (s->next.type != string) return NULL;
 
   attr_node *head = attr(s), *tail = head;
@@ -138,11 +351,13 @@ attr_node *attr_list(token_stream *s) {
   return head;
 }
 
-xml_node *xml_list(token_stream *s);
+static xml_node *xml_list(token_stream *s);
 
-xml_node *xml(token_stream *s) {
-  xml_node *node = calloc(1, sizeof(xml_node));
-  if (!(accept(s, langle, NULL) && accept(s, string, &node->tag))) exit(1);
+static xml_node *xml(token_stream *s) {
+  xml_node *node = alloc(sizeof(xml_node));
+  token tag;
+  if (!(accept(s, langle, NULL) && accept(s, string, &tag))) exit(1);
+  node->tag = tag.id;
 
   node->attrs = attr_list(s);
 
@@ -159,7 +374,7 @@ xml_node *xml(token_stream *s) {
   return node;
 }
 
-xml_node *xml_list(token_stream *s) {
+static xml_node *xml_list(token_stream *s) {
   if (s->next.type != langle) return NULL;
 
   xml_node *head = xml(s), *tail = head;
@@ -174,12 +389,27 @@ typedef struct cmd_node {
     int fill_color;
     int stroke_color;
     float stroke_width;
+    float opacity;
     struct {
       float a, b, c, d, e, f;
     } matrix;
     struct {
       float x1, y1, x2, y2, x, y;
     } path;
+    struct {
+      int w, h;
+    } canvas;
+    struct {
+      float x, y, w, h;
+    } rect;
+    struct {
+      float cx, cy, rx, ry;
+    } ellipse;
+    struct {
+      int id;
+      struct cmd_node *body;
+    } define;
+    int use;
   } args;
   struct cmd_node *next;
 } cmd_node;
@@ -189,21 +419,21 @@ typedef struct cmd_list {
   cmd_node *tail;
 } cmd_list;
 
-void append(cmd_list *l, cmd_node *cmd) {
+static void append(cmd_list *l, cmd_node *cmd) {
   if (!l->head)
     l->head = l->tail = cmd;
   else
     l->tail = l->tail->next = cmd;
 }
 
-int hex(char c) {
+static int hex(char c) {
   if (isdigit(c)) return c - '0';
   if (isupper(c)) return 10 + c - 'A';
   if (islower(c)) return 10 + c - 'a';
   return 0;
 }
 
-int parse_color(char *s) {
+static int parse_color(char *s) {
   int n = strlen(s);
   if (n == 0 || s[0] != '#') return -1;
   if (n == 4)
@@ -234,7 +464,7 @@ typedef struct transform_token_stream {
   char *src;
 } transform_token_stream;
 
-transform_token read_transform_token(transform_token_stream *s) {
+static transform_token read_transform_token(transform_token_stream *s) {
   transform_token t = s->next;
 
   while (isspace(*s->src) || *s->src == ',') ++s->src;
@@ -263,25 +493,25 @@ transform_token read_transform_token(transform_token_stream *s) {
   return t;
 }
 
-char *transform_func(transform_token_stream *s) {
+static char *transform_func(transform_token_stream *s) {
   transform_token t = read_transform_token(s);
   if (t.type != t_func) exit(1);
   return t.value.s;
 }
 
-float transform_arg(transform_token_stream *s) {
+static float transform_arg(transform_token_stream *s) {
   transform_token t = read_transform_token(s);
   if (t.type != t_arg) exit(1);
   return t.value.f;
 }
 
-void compile_matrix(cmd_list *l, char *transform) {
+static void compile_matrix(cmd_list *l, char *transform) {
   transform_token_stream s = {.src = transform};
   read_transform_token(&s);
 
   char *func_name = transform_func(&s);
   if (strcmp(func_name, "matrix") == 0) {
-    cmd_node *cmd = calloc(1, sizeof(cmd_node));
+    cmd_node *cmd = alloc(sizeof(cmd_node));
     cmd->type = push_matrix;
     if (read_transform_token(&s).type != t_lparen) exit(1);
     cmd->args.matrix.a = transform_arg(&s);
@@ -309,7 +539,7 @@ typedef struct path_token_stream {
   char *src;
 } path_token_stream;
 
-path_token read_path_token(path_token_stream *s) {
+static path_token read_path_token(path_token_stream *s) {
   path_token t = s->next;
 
   while (isspace(*s->src) || *s->src == ',') ++s->src;
@@ -320,38 +550,34 @@ path_token read_path_token(path_token_stream *s) {
     s->next = (path_token){.type = p_command, .value.c = *s->src};
     ++s->src;
   } else {
-    int n;
-    float f;
-    if (sscanf(s->src, "%f%n", &f, &n) == 0) exit(1);
+    char *end;
+    float f = strtof(s->src, &end);
+    if (end == s->src) exit(1);
     s->next = (path_token){.type = p_coord, .value.f = f};
-    s->src += n;
+    s->src = end;
   }
   return t;
 }
 
-char path_command(path_token_stream *s) {
+static char path_command(path_token_stream *s) {
   path_token t = read_path_token(s);
   if (t.type != p_command) exit(1);
   return t.value.c;
 }
 
-float path_coord(path_token_stream *s) {
+static float path_coord(path_token_stream *s) {
   path_token t = read_path_token(s);
   if (t.type != p_coord) exit(1);
   return t.value.f;
 }
 
-void compile_path(cmd_list *l, char *d) {
+static void parse_path(cmd_list *l, char *d) {
   path_token_stream s = {.src = d};
   read_path_token(&s);
 
   cmd_type cur_type;
   cmd_node *cmd;
 
-  cmd = calloc(1, sizeof(cmd_node));
-  cmd->type = begin_path;
-  append(l, cmd);
-
   while (s.next.type != p_eos) {
     char c = path_command(&s);
     switch (c) {
@@ -359,7 +585,7 @@ void compile_path(cmd_list *l, char *d) {
       case 'm':
         cur_type = c == 'M' ? move_to : move_to_d;
         while (s.next.type == p_coord) {
-          cmd = calloc(1, sizeof(cmd_node));
+          cmd = alloc(sizeof(cmd_node));
           cmd->type = cur_type;
           cmd->args.path.x = path_coord(&s);
           cmd->args.path.y = path_coord(&s);
@@ -371,7 +597,7 @@ void compile_path(cmd_list *l, char *d) {
       case 'l':
         cur_type = c == 'L' ? line_to : line_to_d;
         while (s.next.type == p_coord) {
-          cmd = calloc(1, sizeof(cmd_node));
+          cmd = alloc(sizeof(cmd_node));
           cmd->type = cur_type;
           cmd->args.path.x = path_coord(&s);
           cmd->args.path.y = path_coord(&s);
@@ -383,7 +609,7 @@ void compile_path(cmd_list *l, char *d) {
       case 'v':
         cur_type = c == 'V' ? v_line_to : v_line_to_d;
         while (s.next.type == p_coord) {
-          cmd = calloc(1, sizeof(cmd_node));
+          cmd = alloc(sizeof(cmd_node));
           cmd->type = cur_type;
           cmd->args.path.y = path_coord(&s);
           append(l, cmd);
@@ -394,7 +620,7 @@ void compile_path(cmd_list *l, char *d) {
       case 'h':
         cur_type = c == 'H' ? h_line_to : h_line_to_d;
         while (s.next.type == p_coord) {
-          cmd = calloc(1, sizeof(cmd_node));
+          cmd = alloc(sizeof(cmd_node));
           cmd->type = cur_type;
           cmd->args.path.x = path_coord(&s);
           append(l, cmd);
@@ -405,7 +631,7 @@ void compile_path(cmd_list *l, char *d) {
       case 'c':
         cur_type = c == 'C' ? curve_to : curve_to_d;
         while (s.next.type == p_coord) {
-          cmd = calloc(1, sizeof(cmd_node));
+          cmd = alloc(sizeof(cmd_node));
           cmd->type = cur_type;
           cmd->args.path.x1 = path_coord(&s);
           cmd->args.path.y1 = path_coord(&s);
@@ -421,7 +647,7 @@ void compile_path(cmd_list *l, char *d) {
       case 's':
         cur_type = c == 'S' ? s_curve_to : s_curve_to_d;
         while (s.next.type == p_coord) {
-          cmd = calloc(1, sizeof(cmd_node));
+          cmd = alloc(sizeof(cmd_node));
           cmd->type = cur_type;
           cmd->args.path.x2 = path_coord(&s);
           cmd->args.path.y2 = path_coord(&s);
@@ -432,7 +658,7 @@ void compile_path(cmd_list *l, char *d) {
         break;
 
       case 'z':
-        cmd = calloc(1, sizeof(cmd_node));
+        cmd = alloc(sizeof(cmd_node));
         cmd->type = close_path;
         append(l, cmd);
         break;
@@ -441,154 +667,1142 @@ void compile_path(cmd_list *l, char *d) {
         exit(1);
     }
   }
-  cmd = calloc(1, sizeof(cmd_node));
+}
+
+typedef struct path_job {
+  char *d;
+  cmd_node *begin;
+  cmd_list chunk;
+} path_job;
+
+typedef struct path_jobs {
+  path_job *jobs;
+  int n;
+  int capacity;
+  int next;
+  pthread_mutex_t lock;
+} path_jobs;
+
+typedef struct path_worker {
+  path_jobs *jobs;
+  arena heap;
+} path_worker;
+
+static int n_threads = 1;
+static int fold;
+static _Thread_local path_jobs *deferred;
+
+static void compile_path(cmd_list *l, char *d) {
+  cmd_node *cmd = alloc(sizeof(cmd_node));
+  cmd->type = begin_path;
+  append(l, cmd);
+
+  if (deferred) {
+    path_jobs *j = deferred;
+    if (j->n == j->capacity) {
+      j->capacity = j->capacity ? 2 * j->capacity : 1024;
+      j->jobs = realloc(j->jobs, j->capacity * sizeof(path_job));
+      if (!j->jobs) exit(1);
+    }
+    j->jobs[j->n++] = (path_job){.d = d, .begin = cmd};
+  } else {
+    parse_path(l, d);
+  }
+
+  cmd = alloc(sizeof(cmd_node));
   cmd->type = fill_and_stroke;
   append(l, cmd);
 }
 
-void emit_draw_commands(cmd_list *l, xml_node *node) {
+static void *parse_paths(void *arg) {
+  path_worker *w = arg;
+  path_jobs *j = w->jobs;
+  heap = w->heap;
+  heap.cur = NULL;
+
+  for (;;) {
+    pthread_mutex_lock(&j->lock);
+    int first = j->next;
+    j->next += 16;
+    pthread_mutex_unlock(&j->lock);
+    if (first >= j->n) break;
+
+    int last = first + 16 < j->n ? first + 16 : j->n;
+    for (int i = first; i < last; ++i) {
+      parse_path(&j->jobs[i].chunk, j->jobs[i].d);
+    }
+  }
+
+  w->heap = heap;
+  return NULL;
+}
+
+// Worker arenas outlive their threads: the chunks they hold are printed after
+// the join, and the blocks are reused by the next document on this thread.
+static void run_path_jobs(path_jobs *j) {
+  static _Thread_local path_worker *workers;
+  static _Thread_local int n_workers;
+
+  int n = n_threads < j->n ? n_threads : j->n;
+  if (n > n_workers) {
+    workers = realloc(workers, n * sizeof(path_worker));
+    if (!workers) exit(1);
+    memset(workers + n_workers, 0, (n - n_workers) * sizeof(path_worker));
+    n_workers = n;
+  }
+
+  pthread_t *threads = calloc(n, sizeof(pthread_t));
+  if (!threads) exit(1);
+  pthread_mutex_init(&j->lock, NULL);
+  for (int i = 0; i < n; ++i) {
+    workers[i].jobs = j;
+    start_worker(&threads[i], parse_paths, &workers[i]);
+  }
+  for (int i = 0; i < n; ++i) join_worker(threads[i]);
+  pthread_mutex_destroy(&j->lock);
+  free(threads);
+
+  for (int i = 0; i < j->n; ++i) {
+    path_job *p = &j->jobs[i];
+    if (!p->chunk.head) continue;
+    p->chunk.tail->next = p->begin->next;
+    p->begin->next = p->chunk.head;
+  }
+}
+
+static cmd_node *add_cmd(cmd_list *l, cmd_type type) {
+  cmd_node *cmd = alloc(sizeof(cmd_node));
+  cmd->type = type;
+  append(l, cmd);
+  return cmd;
+}
+
+static void add_point(cmd_list *l, cmd_type type, float x, float y) {
+  cmd_node *cmd = add_cmd(l, type);
+  cmd->args.path.x = x;
+  cmd->args.path.y = y;
+}
+
+// Quarter of an ellipse around (cx, cy) from its current point to (x, y),
+// leaving along the axis through the current point.
+static void add_quarter(cmd_list *l, float cx, float cy, float x0, float y0,
+                        float x, float y) {
+  const float k = 0.5523f;
+  cmd_node *cmd = add_cmd(l, curve_to);
+  cmd->args.path.x1 = x0 + k * (x - cx);
+  cmd->args.path.y1 = y0 + k * (y - cy);
+  cmd->args.path.x2 = x + k * (x0 - cx);
+  cmd->args.path.y2 = y + k * (y0 - cy);
+  cmd->args.path.x = x;
+  cmd->args.path.y = y;
+}
+
+// Rounded rectangles always go out as paths; plain ones only when folding,
+// since a transformed rectangle is no longer axis-aligned.
+static void compile_rect(cmd_list *l, float x, float y, float w, float h,
+                         float rx, float ry) {
+  if (rx > 0 && ry > 0) {
+    float r = x + w, b = y + h;
+    add_cmd(l, begin_path);
+    add_point(l, move_to, x + rx, y);
+    add_point(l, line_to, r - rx, y);
+    add_quarter(l, r - rx, y + ry, r - rx, y, r, y + ry);
+    add_point(l, line_to, r, b - ry);
+    add_quarter(l, r - rx, b - ry, r, b - ry, r - rx, b);
+    add_point(l, line_to, x + rx, b);
+    add_quarter(l, x + rx, b - ry, x + rx, b, x, b - ry);
+    add_point(l, line_to, x, y + ry);
+    add_quarter(l, x + rx, y + ry, x, y + ry, x + rx, y);
+    add_cmd(l, close_path);
+  } else if (fold) {
+    add_cmd(l, begin_path);
+    add_point(l, move_to, x, y);
+    add_point(l, line_to, x + w, y);
+    add_point(l, line_to, x + w, y + h);
+    add_point(l, line_to, x, y + h);
+    add_cmd(l, close_path);
+  } else {
+    cmd_node *cmd = add_cmd(l, rect);
+    cmd->args.rect.x = x;
+    cmd->args.rect.y = y;
+    cmd->args.rect.w = w;
+    cmd->args.rect.h = h;
+  }
+  add_cmd(l, fill_and_stroke);
+}
+
+static void compile_ellipse(cmd_list *l, cmd_type type, float cx, float cy,
+                            float rx, float ry) {
+  if (fold) {
+    add_cmd(l, begin_path);
+    add_point(l, move_to, cx + rx, cy);
+    add_quarter(l, cx, cy, cx + rx, cy, cx, cy + ry);
+    add_quarter(l, cx, cy, cx, cy + ry, cx - rx, cy);
+    add_quarter(l, cx, cy, cx - rx, cy, cx, cy - ry);
+    add_quarter(l, cx, cy, cx, cy - ry, cx + rx, cy);
+    add_cmd(l, close_path);
+  } else {
+    cmd_node *cmd = add_cmd(l, type);
+    cmd->args.ellipse.cx = cx;
+    cmd->args.ellipse.cy = cy;
+    cmd->args.ellipse.rx = rx;
+    cmd->args.ellipse.ry = ry;
+  }
+  add_cmd(l, fill_and_stroke);
+}
+
+static void compile_points(cmd_list *l, char *s, int closed) {
+  cmd_type type = move_to;
+  add_cmd(l, begin_path);
+  for (;;) {
+    char *end;
+    while (isspace(*s) || *s == ',') ++s;
+    float x = strtof(s, &end);
+    if (end == s) break;
+    for (s = end; isspace(*s) || *s == ','; ++s);
+    float y = strtof(s, &end);
+    if (end == s) break;
+    s = end;
+    add_point(l, type, x, y);
+    type = line_to;
+  }
+  if (closed) add_cmd(l, close_path);
+  add_cmd(l, fill_and_stroke);
+}
+
+// Elements with an id, sorted for lookup by href. A referenced element is
+// emitted once as a definition that every use draws.
+typedef struct symbol {
+  char *id;
+  xml_node *node;
+  int def;
+  int active;
+  cmd_list body;
+} symbol;
+
+typedef struct symbol_table {
+  symbol *v;
+  int n;
+  symbol **defined;
+  int n_defined;
+} symbol_table;
+
+static _Thread_local symbol_table *symbols;
+
+static int count_ids(xml_node *node) {
+  int n = 0;
+  for (; node; node = node->next) {
+    for (attr_node *p = node->attrs; p; p = p->next) n += p->name == name_id;
+    n += count_ids(node->children);
+  }
+  return n;
+}
+
+static void add_ids(symbol_table *t, xml_node *node) {
+  for (; node; node = node->next) {
+    for (attr_node *p = node->attrs; p; p = p->next) {
+      if (p->name == name_id) {
+        t->v[t->n++] = (symbol){.id = p->value, .node = node, .def = -1};
+      }
+    }
+    add_ids(t, node->children);
+  }
+}
+
+static int by_id(const void *a, const void *b) {
+  return strcmp(((const symbol *)a)->id, ((const symbol *)b)->id);
+}
+
+static void index_ids(symbol_table *t, xml_node *dom) {
+  int n = count_ids(dom);
+  t->v = alloc(n * sizeof(symbol));
+  t->defined = alloc(n * sizeof(symbol *));
+  add_ids(t, dom);
+  qsort(t->v, t->n, sizeof(symbol), by_id);
+}
+
+static symbol *find_symbol(char *id) {
+  if (!symbols) return NULL;
+  symbol key = {.id = id};
+  return bsearch(&key, symbols->v, symbols->n, sizeof(symbol), by_id);
+}
+
+static void emit_draw_commands(cmd_list *l, xml_node *node);
+
+static _Thread_local int clipping;
+
+// Under --fold the content is inlined, since folding rewrites its geometry
+// per instance anyway. A use inside the element it refers to is dropped.
+static void compile_use(cmd_list *l, char *href, float x, float y) {
+  symbol *s = href && *href == '#' ? find_symbol(href + 1) : NULL;
+  if (!s || s->active) return;
+
+  if (x != 0 || y != 0) {
+    cmd_node *cmd = add_cmd(l, push_matrix);
+    cmd->args.matrix.a = cmd->args.matrix.d = 1;
+    cmd->args.matrix.e = x;
+    cmd->args.matrix.f = y;
+  }
+  s->active = 1;
+  if (fold) {
+    emit_draw_commands(l, s->node);
+  } else {
+    if (s->def < 0) {
+      int outer = clipping;
+      clipping = 0;
+      emit_draw_commands(&s->body, s->node);
+      clipping = outer;
+      s->def = symbols->n_defined;
+      symbols->defined[symbols->n_defined++] = s;
+    }
+    add_cmd(l, use)->args.use = s->def;
+  }
+  s->active = 0;
+  if (x != 0 || y != 0) add_cmd(l, pop_matrix);
+}
+
+static void compile_shape(cmd_list *l, xml_node *node) {
+  float v[n_names] = {0};
+  int given[n_names] = {0};
+  char *points = NULL, *href = NULL;
+  for (attr_node *p = node->attrs; p; p = p->next) {
+    if (p->name == name_points) points = p->value;
+    if (p->name == name_href || p->name == name_xlink_href) href = p->value;
+    v[p->name] = strtof(p->value, NULL);
+    given[p->name] = 1;
+  }
+  float w = v[name_width], h = v[name_height];
+
+  switch (node->tag) {
+    case name_rect: {
+      float rx = given[name_rx] ? v[name_rx] : v[name_ry];
+      float ry = given[name_ry] ? v[name_ry] : v[name_rx];
+      if (w <= 0 || h <= 0) break;
+      compile_rect(l, v[name_x], v[name_y], w, h, fminf(rx, w / 2),
+                   fminf(ry, h / 2));
+      break;
+    }
+    case name_circle:
+      if (v[name_r] <= 0) break;
+      compile_ellipse(l, circle, v[name_cx], v[name_cy], v[name_r],
+                      v[name_r]);
+      break;
+    case name_ellipse:
+      if (v[name_rx] <= 0 || v[name_ry] <= 0) break;
+      compile_ellipse(l, ellipse, v[name_cx], v[name_cy], v[name_rx],
+                      v[name_ry]);
+      break;
+    case name_line:
+      add_cmd(l, begin_path);
+      add_point(l, move_to, v[name_x1], v[name_y1]);
+      add_point(l, line_to, v[name_x2], v[name_y2]);
+      add_cmd(l, fill_and_stroke);
+      break;
+    case name_polyline:
+    case name_polygon:
+      if (points) compile_points(l, points, node->tag == name_polygon);
+      break;
+    case name_use:
+      compile_use(l, href, v[name_x], v[name_y]);
+      break;
+    default:
+      break;
+  }
+}
+
+// The clip region is the union of a clipPath's shapes, filled, in the user
+// space of the element that refers to it. Only url(#id) references are
+// understood, and clip paths on the shapes themselves are ignored.
+static int compile_clip(cmd_list *l, char *ref) {
+  char *id = alloc(strlen(ref) + 1);
+  if (clipping || sscanf(ref, " url(#%[^) ])", id) != 1) return 0;
+  symbol *s = find_symbol(id);
+  if (!s || s->node->tag != name_clip_path) return 0;
+
+  clipping = 1;
+  add_cmd(l, begin_clip);
+  int has_transform = 0;
+  for (attr_node *p = s->node->attrs; p; p = p->next) {
+    if (p->name != name_transform) continue;
+    has_transform = 1;
+    compile_matrix(l, p->value);
+  }
+  for (xml_node *p = s->node->children; p; p = p->next) {
+    add_cmd(l, save);
+    emit_draw_commands(l, p);
+    add_cmd(l, restore);
+  }
+  if (has_transform) add_cmd(l, pop_matrix);
+  add_cmd(l, end_clip);
+  clipping = 0;
+  return 1;
+}
+
+static void emit_draw_commands(cmd_list *l, xml_node *node) {
   int has_tranform = 0;
+  symbol *self = NULL;
+  char *clip = NULL;
+  float opacity = 1;
 
   for (attr_node *p = node->attrs; p; p = p->next) {
-    if (strcmp(p->name.str, "fill") == 0) {
-      cmd_node *cmd = calloc(1, sizeof(cmd_node));
-      cmd->type = fill_color;
-      cmd->args.fill_color = parse_color(p->value.str);
-      append(l, cmd);
-    } else if (strcmp(p->name.str, "stroke") == 0) {
-      cmd_node *cmd = calloc(1, sizeof(cmd_node));
-      cmd->type = stroke_color;
-      cmd->args.stroke_color = parse_color(p->value.str);
-      append(l, cmd);
-    } else if (strcmp(p->name.str, "stroke-width") == 0) {
-      cmd_node *cmd = calloc(1, sizeof(cmd_node));
-      cmd->type = stroke_width;
-      sscanf(p->value.str, "%f", &cmd->args.stroke_width);
-      append(l, cmd);
-    } else if (strcmp(p->name.str, "transform") == 0) {
-      has_tranform = 1;
-      compile_matrix(l, p->value.str);
+    if (p->name == name_opacity) sscanf(p->value, "%f", &opacity);
+  }
+  if (opacity <= 0 && !clipping) return;
+
+  for (attr_node *p = node->attrs; p; p = p->next) {
+    cmd_node *cmd;
+    switch (p->name) {
+      case name_id:
+        self = find_symbol(p->value);
+        if (self && self->active) self = NULL;
+        if (self) self->active = 1;
+        break;
+      case name_fill:
+        cmd = alloc(sizeof(cmd_node));
+        cmd->type = fill_color;
+        cmd->args.fill_color = parse_color(p->value);
+        append(l, cmd);
+        break;
+      case name_stroke:
+        cmd = alloc(sizeof(cmd_node));
+        cmd->type = stroke_color;
+        cmd->args.stroke_color = parse_color(p->value);
+        append(l, cmd);
+        break;
+      case name_stroke_width:
+        cmd = alloc(sizeof(cmd_node));
+        cmd->type = stroke_width;
+        sscanf(p->value, "%f", &cmd->args.stroke_width);
+        append(l, cmd);
+        break;
+      case name_fill_opacity:
+        cmd = alloc(sizeof(cmd_node));
+        cmd->type = fill_opacity;
+        sscanf(p->value, "%f", &cmd->args.opacity);
+        append(l, cmd);
+        break;
+      case name_stroke_opacity:
+        cmd = alloc(sizeof(cmd_node));
+        cmd->type = stroke_opacity;
+        sscanf(p->value, "%f", &cmd->args.opacity);
+        append(l, cmd);
+        break;
+      case name_transform:
+        has_tranform = 1;
+        compile_matrix(l, p->value);
+        break;
+      case name_clip_path_attr:
+        clip = p->value;
+        break;
+      default:
+        break;
     }
   }
+  int clipped = clip && compile_clip(l, clip);
+  // A translucent element is drawn as a whole into a layer that is then
+  // blended in, so that its parts do not show through each other.
+  int layered = opacity < 1 && !clipping;
+  if (layered) {
+    cmd_node *cmd = alloc(sizeof(cmd_node));
+    cmd->type = begin_layer;
+    cmd->args.opacity = opacity;
+    append(l, cmd);
+  }
 
-  if (strcmp(node->tag.str, "path") == 0) {
+  if (node->tag == name_path) {
     for (attr_node *p = node->attrs; p; p = p->next) {
-      if (strcmp(p->name.str, "d") == 0) {
-        compile_path(l, p->value.str);
-      }
+      if (p->name == name_d) compile_path(l, p->value);
     }
+  } else {
+    compile_shape(l, node);
   }
 
   cmd_node *cmd;
   for (xml_node *p = node->children; p; p = p->next) {
-    cmd = calloc(1, sizeof(cmd_node));
+    if (p->tag == name_defs || p->tag == name_symbol ||
+        p->tag == name_clip_path)
+      continue;
+    cmd = alloc(sizeof(cmd_node));
     cmd->type = save;
     append(l, cmd);
 
     emit_draw_commands(l, p);
 
-    cmd = calloc(1, sizeof(cmd_node));
+    cmd = alloc(sizeof(cmd_node));
     cmd->type = restore;
     append(l, cmd);
   }
 
+  if (layered) add_cmd(l, end_layer);
+  if (clipped) add_cmd(l, pop_clip);
   if (has_tranform) {
-    cmd_node *cmd = calloc(1, sizeof(cmd_node));
+    cmd_node *cmd = alloc(sizeof(cmd_node));
     cmd->type = pop_matrix;
     append(l, cmd);
   }
+  if (self) self->active = 0;
+}
+
+typedef struct style_state {
+  int fill_color;
+  int stroke_color;
+  float stroke_width;
+  float fill_opacity;
+  float stroke_opacity;
+} style_state;
+
+enum {
+  uses_fill = 1,
+  uses_stroke = 2,
+  uses_width = 4,
+  uses_fill_opacity = 8,
+  uses_stroke_opacity = 16,
+  uses_all = 31
+};
+
+static int style_field(cmd_type type) {
+  switch (type) {
+    case fill_color:
+      return uses_fill;
+    case stroke_color:
+      return uses_stroke;
+    case stroke_width:
+      return uses_width;
+    case fill_opacity:
+      return uses_fill_opacity;
+    case stroke_opacity:
+      return uses_stroke_opacity;
+    default:
+      return 0;
+  }
+}
+
+static int same_matrix(cmd_node *p, cmd_node *q) {
+  return memcmp(&p->args.matrix, &q->args.matrix, sizeof(p->args.matrix)) == 0;
 }
 
-void print_draw_commands(cmd_list *l) {
+static int is_identity(cmd_node *p) {
+  return p->args.matrix.a == 1 && p->args.matrix.b == 0 &&
+         p->args.matrix.c == 0 && p->args.matrix.d == 1 &&
+         p->args.matrix.e == 0 && p->args.matrix.f == 0;
+}
+
+static void concat_matrix(cmd_node *p, cmd_node *q) {
+  double a = p->args.matrix.a, b = p->args.matrix.b, c = p->args.matrix.c,
+         d = p->args.matrix.d, e = p->args.matrix.e, f = p->args.matrix.f;
+  p->args.matrix.a = a * q->args.matrix.a + c * q->args.matrix.b;
+  p->args.matrix.b = b * q->args.matrix.a + d * q->args.matrix.b;
+  p->args.matrix.c = a * q->args.matrix.c + c * q->args.matrix.d;
+  p->args.matrix.d = b * q->args.matrix.c + d * q->args.matrix.d;
+  p->args.matrix.e = a * q->args.matrix.e + c * q->args.matrix.f + e;
+  p->args.matrix.f = b * q->args.matrix.e + d * q->args.matrix.f + f;
+}
+
+static int compact(cmd_node **v, int n) {
+  int k = 0;
+  for (int i = 0; i < n; ++i)
+    if (v[i]) v[k++] = v[i];
+  return k;
+}
+
+static int peephole = 1;
+
+// Must start from the same style interpret_commands starts from.
+static void drop_noop_styles(cmd_node **v, int n, style_state *saved) {
+  style_state cur = {.fill_color = 0,
+                     .stroke_color = -1,
+                     .stroke_width = 1,
+                     .fill_opacity = 1,
+                     .stroke_opacity = 1};
+  int depth = 0;
+  for (int i = 0; i < n; ++i) {
+    cmd_node *cmd = v[i];
+    switch (cmd->type) {
+      case save:
+        saved[depth++] = cur;
+        break;
+      case restore:
+        cur = saved[--depth];
+        break;
+      case fill_color:
+        if (cmd->args.fill_color == cur.fill_color) v[i] = NULL;
+        cur.fill_color = cmd->args.fill_color;
+        break;
+      case stroke_color:
+        if (cmd->args.stroke_color == cur.stroke_color) v[i] = NULL;
+        cur.stroke_color = cmd->args.stroke_color;
+        break;
+      case stroke_width:
+        if (cmd->args.stroke_width == cur.stroke_width) v[i] = NULL;
+        cur.stroke_width = cmd->args.stroke_width;
+        break;
+      case fill_opacity:
+        if (cmd->args.opacity == cur.fill_opacity) v[i] = NULL;
+        cur.fill_opacity = cmd->args.opacity;
+        break;
+      case stroke_opacity:
+        if (cmd->args.opacity == cur.stroke_opacity) v[i] = NULL;
+        cur.stroke_opacity = cmd->args.opacity;
+        break;
+      default:
+        break;
+    }
+  }
+}
+
+static void drop_dead_styles(cmd_node **v, int n, int *stack, int *live_out) {
+  int live = 0, depth = 0;
+  for (int i = n - 1; i >= 0; --i) {
+    if (!v[i]) continue;
+    switch (v[i]->type) {
+      case fill_and_stroke:
+      case use:
+        live = uses_all;
+        break;
+      case restore:
+        live_out[i] = stack[depth++] = live;
+        live = 0;
+        break;
+      case save:
+        live |= stack[--depth];
+        break;
+      default: {
+        int field = style_field(v[i]->type);
+        if (!field) break;
+        if (!(live & field)) v[i] = NULL;
+        live &= ~field;
+      }
+    }
+  }
+}
+
+// A save/restore pair is only needed if the restore brings back a value
+// that is read before it is overwritten.
+static void drop_unneeded_saves(cmd_node **v, int n, int *live_out, int *open,
+                                int *dirty) {
+  int depth = 0;
+  for (int i = 0; i < n; ++i) {
+    if (!v[i]) continue;
+    if (v[i]->type == save) {
+      open[depth] = i;
+      dirty[depth++] = 0;
+    } else if (v[i]->type == restore) {
+      --depth;
+      if (!(dirty[depth] & live_out[i])) {
+        v[open[depth]] = v[i] = NULL;
+        if (depth) dirty[depth - 1] |= dirty[depth];
+      }
+    } else if (depth) {
+      dirty[depth - 1] |= style_field(v[i]->type);
+    }
+  }
+}
+
+static void drop_empty_matrices(cmd_node **v, int n, int *open, int *drawn) {
+  int depth = 0;
+  for (int i = 0; i < n; ++i) {
+    if (v[i]->type == push_matrix) {
+      open[depth] = i;
+      drawn[depth++] = 0;
+    } else if (v[i]->type == pop_matrix) {
+      --depth;
+      if (!drawn[depth] || is_identity(v[open[depth]])) {
+        v[open[depth]] = v[i] = NULL;
+      }
+      if (drawn[depth] && depth) drawn[depth - 1] = 1;
+    } else if ((v[i]->type == fill_and_stroke || v[i]->type == use) &&
+               depth) {
+      drawn[depth - 1] = 1;
+    }
+  }
+}
+
+// A pop followed by a push of the same matrix leaves the stack unchanged.
+static void fuse_sibling_matrices(cmd_node **v, int n, int *open) {
+  int depth = 0;
+  for (int i = 0; i < n; ++i) {
+    if (v[i]->type == push_matrix) {
+      open[depth++] = i;
+    } else if (v[i]->type == pop_matrix) {
+      if (i + 1 < n && v[i + 1]->type == push_matrix &&
+          same_matrix(v[open[depth - 1]], v[i + 1])) {
+        v[i] = v[i + 1] = NULL;
+        ++i;
+      } else {
+        --depth;
+      }
+    }
+  }
+}
+
+static void merge_nested_matrices(cmd_node **v, int n, int *open, int *match) {
+  int depth = 0;
+  for (int i = 0; i < n; ++i) {
+    if (v[i]->type == push_matrix) {
+      open[depth++] = i;
+    } else if (v[i]->type == pop_matrix) {
+      match[open[--depth]] = i;
+    }
+  }
+  for (int i = n - 2; i >= 0; --i) {
+    if (v[i]->type != push_matrix || !v[i + 1] ||
+        v[i + 1]->type != push_matrix || match[i + 1] + 1 != match[i])
+      continue;
+    concat_matrix(v[i], v[i + 1]);
+    v[i + 1] = v[match[i + 1]] = NULL;
+  }
+}
+
+// A definition starts from whatever style its use site has, so its style
+// commands can't be checked against the defaults.
+static void optimize_draw_commands(cmd_list *l, int inherited) {
+  int n = 0;
+  for (cmd_node *cmd = l->head; cmd; cmd = cmd->next) ++n;
+  if (!n) return;
+
+  cmd_node **v = malloc(n * sizeof(cmd_node *));
+  int *a = malloc(n * sizeof(int)), *b = malloc(n * sizeof(int));
+  int *c = malloc(n * sizeof(int));
+  style_state *saved = malloc(n * sizeof(style_state));
+  if (!v || !a || !b || !c || !saved) exit(1);
+
+  int k = 0;
+  for (cmd_node *cmd = l->head; cmd; cmd = cmd->next) v[k++] = cmd;
+
+  if (!inherited) drop_noop_styles(v, n, saved);
+  drop_dead_styles(v, n, a, c);
+  drop_unneeded_saves(v, n, c, a, b);
+  k = compact(v, n);
+  drop_empty_matrices(v, k, a, b);
+  k = compact(v, k);
+  fuse_sibling_matrices(v, k, a);
+  k = compact(v, k);
+  merge_nested_matrices(v, k, a, b);
+  k = compact(v, k);
+
+  l->head = l->tail = NULL;
+  for (int i = 0; i < k; ++i) {
+    v[i]->next = NULL;
+    append(l, v[i]);
+  }
+  count(count_emitted, n);
+  count(count_removed, n - k);
+
+  free(v);
+  free(a);
+  free(b);
+  free(c);
+  free(saved);
+}
+
+static void fold_point(cmd_node *m, float *x, float *y) {
+  float px = *x, py = *y;
+  *x = m->args.matrix.a * px + m->args.matrix.c * py + m->args.matrix.e;
+  *y = m->args.matrix.b * px + m->args.matrix.d * py + m->args.matrix.f;
+}
+
+// Rewrites every path command as an absolute move_to, line_to or curve_to in
+// device space, tracking the current, start and reflected control points the
+// way interpret does. Stroke widths are left alone: interpret applies them
+// after transforming, so they are already in device space.
+static void fold_transforms(cmd_list *l) {
+  int n = 0;
+  for (cmd_node *cmd = l->head; cmd; cmd = cmd->next) ++n;
+
+  cmd_node *ctm = malloc((n + 1) * sizeof(cmd_node));
+  if (!ctm) exit(1);
+  ctm[0].args.matrix.a = ctm[0].args.matrix.d = 1;
+  ctm[0].args.matrix.b = ctm[0].args.matrix.c = 0;
+  ctm[0].args.matrix.e = ctm[0].args.matrix.f = 0;
+
+  int depth = 0, n_vertices = 0, pending = 0;
+  float x = 0, y = 0, start_x = 0, start_y = 0, control_x = 0, control_y = 0;
+  cmd_list out = {.head = NULL, .tail = NULL};
+
+  cmd_node *next;
+  for (cmd_node *cmd = l->head; cmd; cmd = next) {
+    next = cmd->next;
+    cmd->next = NULL;
+
+    cmd_type type = cmd->type;
+    switch (type) {
+      case push_matrix:
+        ctm[depth + 1] = ctm[depth];
+        concat_matrix(&ctm[depth + 1], cmd);
+        ++depth;
+        continue;
+      case pop_matrix:
+        --depth;
+        continue;
+      case begin_path:
+        x = y = start_x = start_y = control_x = control_y = 0;
+        n_vertices = 1;
+        pending = 1;
+        append(&out, cmd);
+        continue;
+      case move_to:
+      case move_to_d:
+        break;
+      case close_path:
+        x = start_x;
+        y = start_y;
+        ++n_vertices;
+        append(&out, cmd);
+        continue;
+      default:
+        if (type < move_to || type == fill_and_stroke || type == canvas ||
+            type >= begin_clip) {
+          append(&out, cmd);
+          continue;
+        }
+        if (pending) {
+          cmd_node *head = alloc(sizeof(cmd_node));
+          head->type = move_to;
+          fold_point(&ctm[depth], &head->args.path.x, &head->args.path.y);
+          append(&out, head);
+        }
+    }
+    pending = 0;
+
+    float x1 = control_x, y1 = control_y, x2 = x, y2 = y;
+    int relative = type == move_to_d || type == line_to_d ||
+                   type == v_line_to_d || type == h_line_to_d ||
+                   type == curve_to_d || type == s_curve_to_d;
+    float dx = relative ? x : 0, dy = relative ? y : 0;
+
+    switch (type) {
+      case move_to:
+      case move_to_d:
+      case line_to:
+      case line_to_d:
+        x = dx + cmd->args.path.x;
+        y = dy + cmd->args.path.y;
+        break;
+      case v_line_to:
+      case v_line_to_d:
+        y = dy + cmd->args.path.y;
+        break;
+      case h_line_to:
+      case h_line_to_d:
+        x = dx + cmd->args.path.x;
+        break;
+      case curve_to:
+      case curve_to_d:
+        x1 = dx + cmd->args.path.x1;
+        y1 = dy + cmd->args.path.y1;
+        // fallthrough
+      default:
+        x2 = dx + cmd->args.path.x2;
+        y2 = dy + cmd->args.path.y2;
+        x = dx + cmd->args.path.x;
+        y = dy + cmd->args.path.y;
+        break;
+    }
+
+    if (type == move_to || type == move_to_d) {
+      if (n_vertices == 1) {
+        start_x = x;
+        start_y = y;
+      }
+      cmd->type = move_to;
+    } else {
+      ++n_vertices;
+      cmd->type = type >= curve_to ? curve_to : line_to;
+    }
+
+    cmd->args.path.x = x;
+    cmd->args.path.y = y;
+    fold_point(&ctm[depth], &cmd->args.path.x, &cmd->args.path.y);
+    if (cmd->type == curve_to) {
+      cmd->args.path.x1 = x1;
+      cmd->args.path.y1 = y1;
+      cmd->args.path.x2 = x2;
+      cmd->args.path.y2 = y2;
+      fold_point(&ctm[depth], &cmd->args.path.x1, &cmd->args.path.y1);
+      fold_point(&ctm[depth], &cmd->args.path.x2, &cmd->args.path.y2);
+      control_x = x + (x - x2);
+      control_y = y + (y - y2);
+    } else {
+      control_x = x;
+      control_y = y;
+    }
+    append(&out, cmd);
+  }
+
+  *l = out;
+  free(ctm);
+}
+
+static float length(char *s) {
+  char *end;
+  float f = strtof(s, &end);
+  if (end == s || f <= 0 || (*end && strcmp(end, "px") != 0)) return 0;
+  return f;
+}
+
+// Sizes the canvas from the root element and maps its viewBox onto it
+// (xMidYMid meet). Lengths other than plain or px numbers are ignored.
+// Returns whether a matrix was pushed.
+static int emit_canvas(cmd_list *l, xml_node *root) {
+  float width = 0, height = 0, vb[4];
+  int has_view_box = 0;
+  for (attr_node *p = root->attrs; p; p = p->next) {
+    switch (p->name) {
+      case name_width:
+        width = length(p->value);
+        break;
+      case name_height:
+        height = length(p->value);
+        break;
+      case name_view_box:
+        has_view_box = sscanf(p->value, "%f%*[ ,]%f%*[ ,]%f%*[ ,]%f", &vb[0],
+                              &vb[1], &vb[2], &vb[3]) == 4 &&
+                       vb[2] > 0 && vb[3] > 0;
+        break;
+      default:
+        break;
+    }
+  }
+
+  if (has_view_box) {
+    if (!width && !height) {
+      width = vb[2];
+      height = vb[3];
+    } else if (!width) {
+      width = height * vb[2] / vb[3];
+    } else if (!height) {
+      height = width * vb[3] / vb[2];
+    }
+  }
+  if (!width) width = 900;
+  if (!height) height = 900;
+
+  cmd_node *cmd = alloc(sizeof(cmd_node));
+  cmd->type = canvas;
+  cmd->args.canvas.w = ceilf(width);
+  cmd->args.canvas.h = ceilf(height);
+  append(l, cmd);
+
+  if (!has_view_box) return 0;
+  float sx = width / vb[2], sy = height / vb[3], k = sx < sy ? sx : sy;
+  float tx = (width - vb[2] * k) / 2 - vb[0] * k;
+  float ty = (height - vb[3] * k) / 2 - vb[1] * k;
+  if (k == 1 && tx == 0 && ty == 0) return 0;
+
+  cmd = alloc(sizeof(cmd_node));
+  cmd->type = push_matrix;
+  cmd->args.matrix.a = cmd->args.matrix.d = k;
+  cmd->args.matrix.e = tx;
+  cmd->args.matrix.f = ty;
+  append(l, cmd);
+  return 1;
+}
+
+static void print_draw_commands(cmd_list *l, FILE *out) {
   for (cmd_node *cmd = l->head; cmd; cmd = cmd->next) {
-    printf("%d ", cmd->type);
+    fprintf(out, "%d ", cmd->type);
     switch (cmd->type) {
       case save:
-        printf("save\n");
+        fprintf(out, "save\n");
         break;
       case restore:
-        printf("restore\n");
+        fprintf(out, "restore\n");
         break;
       case stroke_width:
-        printf("stroke_width\n%f\n", cmd->args.stroke_width);
+        fprintf(out, "stroke_width\n%f\n", cmd->args.stroke_width);
         break;
       case stroke_color:
-        printf("stroke_color\n%#x\n", cmd->args.stroke_color);
+        fprintf(out, "stroke_color\n%#x\n", cmd->args.stroke_color);
         break;
       case fill_color:
-        printf("fill_color\n%#x\n", cmd->args.fill_color);
+        fprintf(out, "fill_color\n%#x\n", cmd->args.fill_color);
         break;
       case push_matrix:
-        printf("push_matrix\n%f %f %f %f %f %f\n", cmd->args.matrix.a,
-               cmd->args.matrix.b, cmd->args.matrix.c, cmd->args.matrix.d,
-               cmd->args.matrix.e, cmd->args.matrix.f);
+        fprintf(out, "push_matrix\n%f %f %f %f %f %f\n", cmd->args.matrix.a,
+                cmd->args.matrix.b, cmd->args.matrix.c, cmd->args.matrix.d,
+                cmd->args.matrix.e, cmd->args.matrix.f);
         break;
       case pop_matrix:
-        printf("pop_matrix\n");
+        fprintf(out, "pop_matrix\n");
         break;
       case begin_path:
-        printf("begin_path\n");
+        fprintf(out, "begin_path\n");
         break;
       case move_to:
-        printf("move_to\n%f %f\n", cmd->args.path.x, cmd->args.path.y);
+        fprintf(out, "move_to\n%f %f\n", cmd->args.path.x, cmd->args.path.y);
         break;
       case move_to_d:
-        printf("move_to_d\n%f %f\n", cmd->args.path.x, cmd->args.path.y);
+        fprintf(out, "move_to_d\n%f %f\n", cmd->args.path.x, cmd->args.path.y);
         break;
       case line_to:
-        printf("line_to\n%f %f\n", cmd->args.path.x, cmd->args.path.y);
+        fprintf(out, "line_to\n%f %f\n", cmd->args.path.x, cmd->args.path.y);
         break;
       case line_to_d:
-        printf("line_to_d\n%f %f\n", cmd->args.path.x, cmd->args.path.y);
+        fprintf(out, "line_to_d\n%f %f\n", cmd->args.path.x, cmd->args.path.y);
         break;
       case v_line_to:
-        printf("v_line_to\n%f\n", cmd->args.path.y);
+        fprintf(out, "v_line_to\n%f\n", cmd->args.path.y);
         break;
       case v_line_to_d:
-        printf("v_line_to_d\n%f\n", cmd->args.path.y);
+        fprintf(out, "v_line_to_d\n%f\n", cmd->args.path.y);
         break;
       case h_line_to:
-        printf("h_line_to\n%f\n", cmd->args.path.x);
+        fprintf(out, "h_line_to\n%f\n", cmd->args.path.x);
         break;
       case h_line_to_d:
-        printf("h_line_to_d\n%f\n", cmd->args.path.x);
+        fprintf(out, "h_line_to_d\n%f\n", cmd->args.path.x);
         break;
       case curve_to:
-        printf("curve_to\n%f %f %f %f %f %f\n", cmd->args.path.x1,
-               cmd->args.path.y1, cmd->args.path.x2, cmd->args.path.y2,
-               cmd->args.path.x, cmd->args.path.y);
+        fprintf(out, "curve_to\n%f %f %f %f %f %f\n", cmd->args.path.x1,
+                cmd->args.path.y1, cmd->args.path.x2, cmd->args.path.y2,
+                cmd->args.path.x, cmd->args.path.y);
         break;
       case curve_to_d:
-        printf("curve_to_d\n%f %f %f %f %f %f\n", cmd->args.path.x1,
-               cmd->args.path.y1, cmd->args.path.x2, cmd->args.path.y2,
-               cmd->args.path.x, cmd->args.path.y);
+        fprintf(out, "curve_to_d\n%f %f %f %f %f %f\n", cmd->args.path.x1,
+                cmd->args.path.y1, cmd->args.path.x2, cmd->args.path.y2,
+                cmd->args.path.x, cmd->args.path.y);
         break;
       case s_curve_to:
-        printf("s_curve_to\n%f %f %f %f\n", cmd->args.path.x2,
-               cmd->args.path.y2, cmd->args.path.x, cmd->args.path.y);
+        fprintf(out, "s_curve_to\n%f %f %f %f\n", cmd->args.path.x2,
+                cmd->args.path.y2, cmd->args.path.x, cmd->args.path.y);
         break;
       case s_curve_to_d:
-        printf("s_curve_to_d\n%f %f %f %f\n", cmd->args.path.x2,
-               cmd->args.path.y2, cmd->args.path.x, cmd->args.path.y);
+        fprintf(out, "s_curve_to_d\n%f %f %f %f\n", cmd->args.path.x2,
+                cmd->args.path.y2, cmd->args.path.x, cmd->args.path.y);
         break;
       case close_path:
-        printf("close_path\n");
+        fprintf(out, "close_path\n");
         break;
       case fill_and_stroke:
-        printf("fill_and_stroke\n");
+        fprintf(out, "fill_and_stroke\n");
+        break;
+      case canvas:
+        fprintf(out, "canvas\n%d %d\n", cmd->args.canvas.w,
+                cmd->args.canvas.h);
+        break;
+      case rect:
+        fprintf(out, "rect\n%f %f %f %f\n", cmd->args.rect.x,
+                cmd->args.rect.y, cmd->args.rect.w, cmd->args.rect.h);
+        break;
+      case circle:
+        fprintf(out, "circle\n%f %f %f\n", cmd->args.ellipse.cx,
+                cmd->args.ellipse.cy, cmd->args.ellipse.rx);
+        break;
+      case ellipse:
+        fprintf(out, "ellipse\n%f %f %f %f\n", cmd->args.ellipse.cx,
+                cmd->args.ellipse.cy, cmd->args.ellipse.rx,
+                cmd->args.ellipse.ry);
+        break;
+      case define: {
+        char *body = NULL;
+        size_t n = 0;
+        FILE *s = open_memstream(&body, &n);
+        print_draw_commands(&(cmd_list){.head = cmd->args.define.body}, s);
+        fclose(s);
+        fprintf(out, "define\n%d %zu\n", cmd->args.define.id, n);
+        fwrite(body, 1, n, out);
+        free(body);
+        break;
+      }
+      case use:
+        fprintf(out, "use\n%d\n", cmd->args.use);
+        break;
+      case begin_clip:
+        fprintf(out, "begin_clip\n");
+        break;
+      case end_clip:
+        fprintf(out, "end_clip\n");
+        break;
+      case pop_clip:
+        fprintf(out, "pop_clip\n");
+        break;
+      case fill_opacity:
+        fprintf(out, "fill_opacity\n%f\n", cmd->args.opacity);
+        break;
+      case stroke_opacity:
+        fprintf(out, "stroke_opacity\n%f\n", cmd->args.opacity);
+        break;
+      case begin_layer:
+        fprintf(out, "begin_layer\n%f\n", cmd->args.opacity);
+        break;
+      case end_layer:
+        fprintf(out, "end_layer\n");
         break;
     }
   }
 }
 
-int main() {
-  token_stream s;
+void compile_svg(FILE *in, FILE *out) {
+  heap.cur = NULL;
+
+  token_stream s = {.src.in = in};
   read_char(&s.src);
   read_token(&s);
 
-  cmd_list l = {.head = NULL, .tail = NULL};
+  enter_phase(phase_dom_build);
   xml_node *dom = xml(&s);
+  leave_phase();
+
+  enter_phase(phase_emit);
+  cmd_list l = {.head = NULL, .tail = NULL};
+  path_jobs jobs = {0};
+  if (n_threads > 1) deferred = &jobs;
+  symbol_table table = {0};
+  index_ids(&table, dom);
+  symbols = &table;
+  int view_box = dom->tag == name_svg && emit_canvas(&l, dom);
   emit_draw_commands(&l, dom);
-  print_draw_commands(&l);
+  if (view_box) {
+    cmd_node *cmd = alloc(sizeof(cmd_node));
+    cmd->type = pop_matrix;
+    append(&l, cmd);
+  }
+  deferred = NULL;
+  symbols = NULL;
+  if (jobs.n) run_path_jobs(&jobs);
+  free(jobs.jobs);
+  leave_phase();
+
+  if (fold || peephole) {
+    enter_phase(phase_optimize);
+    if (fold) fold_transforms(&l);
+    if (peephole) {
+      optimize_draw_commands(&l, 0);
+      for (int i = 0; i < table.n_defined; ++i) {
+        optimize_draw_commands(&table.defined[i]->body, 1);
+      }
+    }
+    leave_phase();
+  }
+
+  // Definitions go first, innermost first, so interpret has each one
+  // before the first use that refers to it.
+  for (int i = table.n_defined - 1; i >= 0; --i) {
+    cmd_node *cmd = alloc(sizeof(cmd_node));
+    cmd->type = define;
+    cmd->args.define.id = i;
+    cmd->args.define.body = table.defined[i]->body.head;
+    cmd->next = l.head;
+    l.head = cmd;
+  }
+
+  enter_phase(phase_emit);
+  print_draw_commands(&l, out);
+  leave_phase();
+}
+
+#ifndef NO_MAIN
+int main(int argc, char *argv[]) {
+  argc = stats_option(argc, argv);
+  for (int i = 1; i < argc; ++i) {
+    if (strcmp(argv[i], "-O0") == 0) peephole = 0;
+    if (strcmp(argv[i], "--fold") == 0) fold = 1;
+    if (strcmp(argv[i], "-j") == 0 && i + 1 < argc) {
+      sscanf(argv[++i], "%d", &n_threads);
+    }
+  }
+  compile_svg(stdin, stdout);
+  if (run_stats.enabled) print_stats(stderr, "compile", NULL);
   return 0;
-}
\ No newline at end of file
+}
+#endif
\ No newline at end of file
@@ -0,0 +1,341 @@
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static unsigned long long seed = 0x2545f4914f6cdd1d;
+
+static float uniform(float lo, float hi) {
+  seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+  return lo + (hi - lo) * ((seed >> 40) / (float)(1 << 24));
+}
+
+static int color(void) { return (int)uniform(0, 1 << 24) & 0xffffff; }
+
+static void begin(void) {
+  printf("<svg xmlns=\"http://www.w3.org/2000/svg\" "
+         "viewBox=\"0 0 900 900\">\n");
+}
+
+static void end(void) { printf("</svg>\n"); }
+
+static void small_paths(int n) {
+  begin();
+  for (int i = 0; i < n; ++i) {
+    float x = uniform(0, 880), y = uniform(0, 880);
+    printf("<path fill=\"#%06x\" "
+           "d=\"M%.2f,%.2f l%.2f,%.2f l%.2f,%.2f z\"/>\n",
+           color(), x, y, uniform(2, 20), uniform(-5, 5), uniform(-10, 10),
+           uniform(2, 20));
+  }
+  end();
+}
+
+static void huge_paths(int n) {
+  begin();
+  for (int i = 0; i < n; ++i) {
+    int k = 5000;
+    float cx = uniform(200, 700), cy = uniform(200, 700);
+    printf("<path fill=\"#%06x\" d=\"M%.2f,%.2f", color(), cx + 200, cy);
+    for (int j = 1; j <= k; ++j) {
+      float t = 2 * M_PI * j / k, r = 100 + 100 * (j % 2);
+      printf(" L%.2f,%.2f", cx + r * cosf(t), cy + r * sinf(t));
+    }
+    printf(" z\"/>\n");
+  }
+  end();
+}
+
+static void nested_transforms(int n) {
+  begin();
+  for (int i = 0; i < n; ++i) {
+    float t = uniform(-0.05, 0.05), s = uniform(0.99, 1.01);
+    printf("<g fill=\"#%06x\" transform=\"matrix(%f,%f,%f,%f,%f,%f)\">\n",
+           color(), s * cosf(t), s * sinf(t), -s * sinf(t), s * cosf(t),
+           uniform(-2, 2), uniform(-2, 2));
+    printf("<path d=\"M400,400 c10,-20 30,-20 40,0 s-30,20 -40,0 z\"/>\n");
+  }
+  for (int i = 0; i < n; ++i) printf("</g>\n");
+  end();
+}
+
+static void long_strokes(int n) {
+  begin();
+  for (int i = 0; i < n; ++i) {
+    float x = uniform(50, 850), y = uniform(50, 850);
+    printf("<path fill=\"none\" stroke=\"#%06x\" stroke-width=\"%.1f\" "
+           "d=\"M%.2f,%.2f",
+           color(), uniform(1, 6), x, y);
+    for (int j = 0; j < 200; ++j) {
+      float dx = uniform(-20, 20), dy = uniform(-20, 20);
+      if (x + dx < 0 || x + dx > 900) dx = -dx;
+      if (y + dy < 0 || y + dy > 900) dy = -dy;
+      x += dx;
+      y += dy;
+      printf(" l%.2f,%.2f", dx, dy);
+    }
+    printf("\"/>\n");
+  }
+  end();
+}
+
+static void overdraw(int n) {
+  begin();
+  for (int i = 0; i < n; ++i) {
+    float cx = uniform(300, 600), cy = uniform(300, 600);
+    float r = uniform(300, 450), k = 0.5523f * r;
+    printf("<path fill=\"#%06x\" d=\"M%.2f,%.2f", color(), cx + r, cy);
+    printf(" C%.2f,%.2f %.2f,%.2f %.2f,%.2f", cx + r, cy + k, cx + k, cy + r,
+           cx, cy + r);
+    printf(" C%.2f,%.2f %.2f,%.2f %.2f,%.2f", cx - k, cy + r, cx - r, cy + k,
+           cx - r, cy);
+    printf(" C%.2f,%.2f %.2f,%.2f %.2f,%.2f", cx - r, cy - k, cx - k, cy - r,
+           cx, cy - r);
+    printf(" C%.2f,%.2f %.2f,%.2f %.2f,%.2f z\"/>\n", cx + k, cy - r, cx + r,
+           cy - k, cx + r, cy);
+  }
+  end();
+}
+
+static void long_d(int n) {
+  begin();
+  printf("<path fill=\"#%06x\" stroke=\"#000\" d=\"M450,450", color());
+  for (int i = 0; i < n; ++i) {
+    printf(" c%.2f,%.2f %.2f,%.2f %.2f,%.2f", uniform(-10, 10),
+           uniform(-10, 10), uniform(-10, 10), uniform(-10, 10),
+           uniform(-3, 3), uniform(-3, 3));
+  }
+  printf(" z\"/>\n");
+  end();
+}
+
+static void shapes(int n) {
+  begin();
+  for (int i = 0; i < n; ++i) {
+    float x = uniform(0, 800), y = uniform(0, 800);
+    switch (i % 6) {
+      case 0:
+        printf("<rect fill=\"#%06x\" x=\"%.2f\" y=\"%.2f\" width=\"%.2f\" "
+               "height=\"%.2f\"/>\n",
+               color(), x, y, uniform(1, 100), uniform(1, 100));
+        break;
+      case 1: {
+        float t = uniform(0, M_PI / 2);
+        printf("<rect fill=\"#%06x\" stroke=\"#%06x\" "
+               "transform=\"matrix(%f,%f,%f,%f,%.2f,%.2f)\" width=\"%.2f\" "
+               "height=\"%.2f\" rx=\"%.2f\"/>\n",
+               color(), color(), cosf(t), sinf(t), -sinf(t), cosf(t), x, y,
+               uniform(10, 100), uniform(10, 100), uniform(0, 20));
+        break;
+      }
+      case 2:
+        printf("<circle fill=\"#%06x\" cx=\"%.2f\" cy=\"%.2f\" "
+               "r=\"%.2f\"/>\n",
+               color(), x, y, uniform(1, 80));
+        break;
+      case 3:
+        printf("<ellipse fill=\"#%06x\" stroke=\"#%06x\" cx=\"%.2f\" "
+               "cy=\"%.2f\" rx=\"%.2f\" ry=\"%.2f\"/>\n",
+               color(), color(), x, y, uniform(1, 80), uniform(1, 80));
+        break;
+      case 4:
+        printf("<line stroke=\"#%06x\" stroke-width=\"%.1f\" x1=\"%.2f\" "
+               "y1=\"%.2f\" x2=\"%.2f\" y2=\"%.2f\"/>\n",
+               color(), uniform(1, 6), x, y, x + uniform(-100, 100),
+               y + uniform(-100, 100));
+        break;
+      case 5:
+        printf("<%s fill=\"#%06x\" points=\"",
+               i % 12 < 6 ? "polygon" : "polyline", color());
+        for (int j = 0; j < 6; ++j) {
+          printf("%s%.2f,%.2f", j ? " " : "", x + uniform(0, 100),
+                 y + uniform(0, 100));
+        }
+        printf("\"/>\n");
+        break;
+    }
+  }
+  end();
+}
+
+static void symbols(int n) {
+  begin();
+  printf("<defs>\n<symbol id=\"petal\">\n"
+         "<path d=\"M0,0 c4,-8 12,-8 16,0 s-12,8 -16,0 z\"/>\n"
+         "<circle fill=\"none\" stroke=\"#000\" cx=\"8\" cy=\"0\" "
+         "r=\"2\"/>\n</symbol>\n");
+  printf("<g id=\"flower\">\n");
+  for (int i = 0; i < 5; ++i) {
+    float t = 2 * M_PI * i / 5;
+    printf("<use href=\"#petal\" transform=\"matrix(%f,%f,%f,%f,0,0)\"/>\n",
+           cosf(t), sinf(t), -sinf(t), cosf(t));
+  }
+  printf("</g>\n</defs>\n");
+  for (int i = 0; i < n; ++i) {
+    float x = uniform(20, 880), y = uniform(20, 880);
+    if (i % 10 == 0) {
+      printf("<use href=\"#flower\" fill=\"#%06x\" "
+             "transform=\"matrix(2.5,0,0,2.5,%.2f,%.2f)\"/>\n",
+             color(), x, y);
+    } else {
+      printf("<use href=\"#%s\" fill=\"#%06x\" x=\"%.2f\" y=\"%.2f\"/>\n",
+             i % 2 ? "petal" : "flower", i % 3 ? 0x336699 : 0x993333, x, y);
+    }
+  }
+  end();
+}
+
+static void clips(int n) {
+  begin();
+  printf("<defs>\n"
+         "<clipPath id=\"frame\"><rect x=\"50\" y=\"50\" width=\"800\" "
+         "height=\"800\"/></clipPath>\n"
+         "<clipPath id=\"lens\"><circle cx=\"450\" cy=\"450\" r=\"250\"/>"
+         "<path d=\"M450,50 L850,700 L50,700 z\"/></clipPath>\n"
+         "<clipPath id=\"tilt\" "
+         "transform=\"matrix(0.8,0.6,-0.6,0.8,360,-180)\">"
+         "<rect x=\"200\" y=\"200\" width=\"500\" height=\"300\"/>"
+         "</clipPath>\n"
+         "<symbol id=\"badge\">\n"
+         "<clipPath id=\"half\"><rect x=\"-20\" y=\"0\" width=\"40\" "
+         "height=\"20\"/></clipPath>\n"
+         "<circle fill=\"#000\" cx=\"0\" cy=\"0\" r=\"20\"/>\n"
+         "<circle fill=\"#fff\" clip-path=\"url(#half)\" cx=\"0\" "
+         "cy=\"0\" r=\"20\"/>\n</symbol>\n</defs>\n");
+  printf("<g clip-path=\"url(#frame)\">\n");
+  for (int i = 0; i < n; ++i) {
+    float x = uniform(0, 850), y = uniform(0, 850), r = uniform(5, 60);
+    const char *clip[] = {"", "lens", "tilt", "own"};
+    if (i % 4 == 3) {
+      printf("<clipPath id=\"c%d\"><rect x=\"%.2f\" y=\"%.2f\" "
+             "width=\"%.2f\" height=\"%.2f\"/></clipPath>\n",
+             i, x, y, uniform(10, 80), uniform(10, 80));
+      printf("<circle fill=\"#%06x\" clip-path=\"url(#c%d)\" ", color(),
+             i);
+    } else if (i % 4) {
+      printf("<circle fill=\"#%06x\" clip-path=\"url(#%s)\" ", color(),
+             clip[i % 4]);
+    } else {
+      printf("<circle fill=\"#%06x\" ", color());
+    }
+    printf("stroke=\"#%06x\" stroke-width=\"%.1f\" cx=\"%.2f\" "
+           "cy=\"%.2f\" r=\"%.2f\"/>\n",
+           color(), uniform(1, 4), x + r, y + r, r);
+    if (i % 25 == 0) {
+      printf("<use href=\"#badge\" x=\"%.2f\" y=\"%.2f\"/>\n", x, y);
+    }
+  }
+  printf("</g>\n");
+  end();
+}
+
+static void opacity(int n) {
+  begin();
+  printf("<defs>\n"
+         "<clipPath id=\"band\"><rect x=\"0\" y=\"300\" width=\"900\" "
+         "height=\"300\"/></clipPath>\n"
+         "<symbol id=\"pair\">\n<g opacity=\"0.6\">\n"
+         "<circle fill=\"#c03030\" cx=\"0\" cy=\"0\" r=\"15\"/>\n"
+         "<circle fill=\"#3030c0\" cx=\"12\" cy=\"0\" r=\"15\"/>\n"
+         "</g>\n</symbol>\n</defs>\n");
+  printf("<g opacity=\"0.8\" clip-path=\"url(#band)\">\n");
+  for (int i = 0; i < n; ++i) {
+    float x = uniform(0, 850), y = uniform(0, 850), r = uniform(5, 50);
+    switch (i % 5) {
+      case 0:
+        printf("<g opacity=\"%.2f\" stroke=\"#%06x\" stroke-width=\"%.1f\">"
+               "\n<rect fill=\"#%06x\" x=\"%.2f\" y=\"%.2f\" "
+               "width=\"%.2f\" height=\"%.2f\"/>\n",
+               uniform(0.2, 0.9), color(), uniform(1, 5), color(), x, y,
+               2 * r, r);
+        printf("<circle fill=\"#%06x\" cx=\"%.2f\" cy=\"%.2f\" "
+               "r=\"%.2f\"/>\n</g>\n",
+               color(), x + r, y + r, r);
+        break;
+      case 1:
+        printf("<circle fill=\"#%06x\" fill-opacity=\"%.2f\" "
+               "stroke=\"#%06x\" stroke-opacity=\"%.2f\" "
+               "stroke-width=\"%.1f\" cx=\"%.2f\" cy=\"%.2f\" "
+               "r=\"%.2f\"/>\n",
+               color(), uniform(0.1, 1), color(), uniform(0.1, 1),
+               uniform(2, 8), x, y, r);
+        break;
+      case 2:
+        printf("<rect opacity=\"%.2f\" fill=\"#%06x\" x=\"%.2f\" "
+               "y=\"%.2f\" width=\"%.2f\" height=\"%.2f\"/>\n",
+               uniform(0.1, 1), color(), x, y, r, 2 * r);
+        break;
+      case 3:
+        printf("<g opacity=\"0.5\">\n<g opacity=\"0.5\" fill=\"#%06x\">"
+               "\n<circle cx=\"%.2f\" cy=\"%.2f\" r=\"%.2f\"/>\n"
+               "<circle cx=\"%.2f\" cy=\"%.2f\" r=\"%.2f\"/>\n</g>\n"
+               "<rect fill=\"#%06x\" x=\"%.2f\" y=\"%.2f\" "
+               "width=\"%.2f\" height=\"%.2f\"/>\n</g>\n",
+               color(), x, y, r, x + r, y, r, color(), x, y, r, r);
+        break;
+      case 4:
+        printf("<use href=\"#pair\" x=\"%.2f\" y=\"%.2f\"/>\n", x, y);
+        break;
+    }
+  }
+  printf("</g>\n");
+  end();
+}
+
+// Long runs of empty clipped and translucent groups, which interpret queues
+// as jobs that are already done, ahead of ordinary paths.
+static void runs(int n) {
+  begin();
+  printf("<defs><clipPath id=\"c\"><rect x=\"0\" y=\"0\" width=\"500\" "
+         "height=\"500\"/></clipPath></defs>\n");
+  for (int i = 0; i < n; ++i) {
+    printf(i % 2 ? "<g clip-path=\"url(#c)\"></g>\n"
+                 : "<g opacity=\"0.5\"></g>\n");
+  }
+  for (int i = 0; i < n / 16; ++i) {
+    printf("<path fill=\"#%06x\" d=\"M%.2f,%.2f c10,-20 30,-20 40,0 "
+           "s-30,20 -40,0 z\"/>\n",
+           color(), uniform(0, 800), uniform(0, 800));
+  }
+  end();
+}
+
+typedef struct scene {
+  const char *name;
+  void (*generate)(int n);
+  int n;
+} scene;
+
+static const scene scenes[] = {
+    {"small", small_paths, 20000},
+    {"huge", huge_paths, 4},
+    {"nested", nested_transforms, 500},
+    {"strokes", long_strokes, 100},
+    {"overdraw", overdraw, 200},
+    {"long", long_d, 10000},
+    {"shapes", shapes, 3000},
+    {"symbols", symbols, 2000},
+    {"clips", clips, 2000},
+    {"opacity", opacity, 2000},
+    {"runs", runs, 5000},
+};
+
+int main(int argc, char *argv[]) {
+  int n_scenes = sizeof(scenes) / sizeof(scene);
+  if (argc < 2) {
+    for (int i = 0; i < n_scenes; ++i) printf("%s\n", scenes[i].name);
+    return 0;
+  }
+
+  float factor = 1;
+  if (argc >= 3) sscanf(argv[2], "%f", &factor);
+
+  for (int i = 0; i < n_scenes; ++i) {
+    if (strcmp(argv[1], scenes[i].name) == 0) {
+      int n = scenes[i].n * factor;
+      scenes[i].generate(n < 1 ? 1 : n);
+      return 0;
+    }
+  }
+  return 1;
+}
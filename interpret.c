@@ -1,9 +1,12 @@
 #include <math.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
 #include "cmd.h"
+#include "stats.h"
+#include "svg.h"
 
 typedef struct point {
   float x, y;
@@ -13,9 +16,9 @@ typedef struct vec3 {
   float v[3];
 } vec3;
 
-vec3 to_vec(point p) { return (vec3){.v = {p.x, p.y, 1.0f}}; }
+static vec3 to_vec(point p) { return (vec3){.v = {p.x, p.y, 1.0f}}; }
 
-point to_point(vec3 v) {
+static point to_point(vec3 v) {
   return (point){.x = v.v[0] / v.v[2], .y = v.v[1] / v.v[2]};
 }
 
@@ -23,7 +26,7 @@ typedef struct mat3 {
   float v[3][3];
 } mat3;
 
-mat3 identity(void) {
+static mat3 identity(void) {
   mat3 p = {0};
   for (int i = 0; i < 3; ++i) {
     p.v[i][i] = 1.0f;
@@ -31,7 +34,7 @@ mat3 identity(void) {
   return p;
 }
 
-mat3 mult(mat3 m1, mat3 m2) {
+static mat3 mult(mat3 m1, mat3 m2) {
   mat3 p = {0};
   for (int i = 0; i < 3; ++i) {
     for (int j = 0; j < 3; ++j) {
@@ -43,7 +46,7 @@ mat3 mult(mat3 m1, mat3 m2) {
   return p;
 }
 
-vec3 apply(mat3 m, vec3 x) {
+static vec3 apply(mat3 m, vec3 x) {
   vec3 y = {0};
   for (int i = 0; i < 3; ++i) {
     for (int j = 0; j < 3; ++j) {
@@ -53,13 +56,26 @@ vec3 apply(mat3 m, vec3 x) {
   return y;
 }
 
+// set records which fields were given inside a definition; the others come
+// from each use site.
 typedef struct style {
   int fill_color;
   int stroke_color;
   float stroke_width;
+  float fill_opacity;
+  float stroke_opacity;
+  int set;
   struct style *parent;
 } style;
 
+enum {
+  set_fill = 1,
+  set_stroke = 2,
+  set_width = 4,
+  set_fill_opacity = 8,
+  set_stroke_opacity = 16
+};
+
 typedef struct transform {
   mat3 matrix;
   struct transform *parent;
@@ -67,10 +83,13 @@ typedef struct transform {
 
 typedef struct vertex {
   point pos;
+  int curve;
+  int dropped;
+  point c1, c2, c3;
   struct vertex *next;
 } vertex;
 
-void free_list(vertex *l) {
+static void free_list(vertex *l) {
   if (l) {
     free_list(l->next);
     free(l);
@@ -82,25 +101,70 @@ typedef struct path {
   vertex *tail;
 } path;
 
-void clear(path *p) {
+static void clear(path *p) {
   free_list(p->head);
   p->head = p->tail = NULL;
 }
 
-int size(path *l) {
+static int size(path *l) {
   int n = 0;
   for (vertex *p = l->head; p; p = p->next) ++n;
   return n;
 }
 
+// What a piece of output covers: the bounding box of its polygons, how many
+// there are, and whether anything other than plain polygons went out.
+typedef struct bounds {
+  float box[4];
+  int polygons;
+  int nested;
+} bounds;
+
+static const bounds no_bounds = {
+    .box = {INFINITY, INFINITY, -INFINITY, -INFINITY}};
+
+static void add_bounds(bounds *b, const bounds *c) {
+  for (int i = 0; i < 2; ++i) {
+    if (c->box[i] < b->box[i]) b->box[i] = c->box[i];
+    if (c->box[i + 2] > b->box[i + 2]) b->box[i + 2] = c->box[i + 2];
+  }
+  b->polygons += c->polygons;
+  b->nested |= c->nested;
+}
+
+// An open group. Its output is held back until it closes, so that its
+// bounding box can go out ahead of it; below is the stream it replaced.
+typedef struct layer {
+  float alpha;
+  bounds bounds;
+  char *text;
+  size_t size;
+  FILE *out, *below;
+  struct layer *parent;
+} layer;
+
 typedef struct context {
   style *style;
   transform *transforms;
   path path;
   point control;
+  float tolerance;
+  FILE *in;
+  FILE *out;
+  struct paint_queue *queue;
+  struct symbol_table *symbols;
+  struct symbol_cache *recording;
+  transform *document;  // the viewBox transform pushed after the canvas
+  int canvas;
+  FILE *clip;
+  char *clip_text;
+  size_t clip_size;
+  int clip_polygons, clip_nested;
+  layer *layer;
+  bounds *bounds;
 } context;
 
-void save_style(context *ctx) {
+static void save_style(context *ctx) {
   style *s = calloc(1, sizeof(style));
   if (!ctx->style) exit(1);
   memcpy(s, ctx->style, sizeof(style));
@@ -108,14 +172,14 @@ void save_style(context *ctx) {
   ctx->style = s;
 }
 
-void restore_style(context *ctx) {
+static void restore_style(context *ctx) {
   style *s = ctx->style;
   if (!s || !s->parent) exit(1);
   ctx->style = s->parent;
   free(s);
 }
 
-mat3 get_transform(context *ctx) {
+static mat3 get_transform(context *ctx) {
   mat3 m = identity();
   for (transform *t = ctx->transforms; t; t = t->parent) {
     m = mult(t->matrix, m);
@@ -123,37 +187,38 @@ mat3 get_transform(context *ctx) {
   return m;
 }
 
-void push_transform(context *ctx, mat3 m) {
+static void push_transform(context *ctx, mat3 m) {
   transform *t = calloc(1, sizeof(transform));
   t->matrix = m;
   t->parent = ctx->transforms;
   ctx->transforms = t;
 }
 
-void pop_transform(context *ctx) {
+static void pop_transform(context *ctx) {
   transform *t = ctx->transforms;
   if (!t) exit(1);
+  if (t == ctx->document) ctx->document = NULL;
   ctx->transforms = t->parent;
   free(t);
 }
 
-point *start_point(context *ctx) {
+static point *start_point(context *ctx) {
   if (!ctx->path.head) exit(1);
   return &ctx->path.head->pos;
 }
 
-point *current_point(context *ctx) {
+static point *current_point(context *ctx) {
   if (!ctx->path.tail) exit(1);
   return &ctx->path.tail->pos;
 }
 
-void set_tangent(context *ctx, float tx, float ty) {
+static void set_tangent(context *ctx, float tx, float ty) {
   point *p = current_point(ctx);
   ctx->control.x = p->x + tx;
   ctx->control.y = p->y + ty;
 }
 
-void add_to_path(context *ctx, float x, float y) {
+static void add_to_path(context *ctx, float x, float y) {
   vertex *v = calloc(1, sizeof(vertex));
   v->pos.x = x;
   v->pos.y = y;
@@ -164,23 +229,29 @@ void add_to_path(context *ctx, float x, float y) {
   }
 }
 
-void reset_path(context *ctx) {
+static void add_curve(context *ctx, float x1, float y1, float x2, float y2,
+                      float x3, float y3) {
+  add_to_path(ctx, x3, y3);
+  vertex *v = ctx->path.tail;
+  v->curve = 1;
+  count(count_curves, 1);
+  v->c1 = (point){x1, y1};
+  v->c2 = (point){x2, y2};
+  v->c3 = (point){x3, y3};
+}
+
+static void reset_path(context *ctx) {
   clear(&ctx->path);
   add_to_path(ctx, 0, 0);
   ctx->control = *current_point(ctx);
 }
 
-float dist(float x1, float y1, float x2, float y2) {
-  float dx = x2 - x1, dy = y2 - y1;
-  return sqrtf(dx * dx + dy * dy);
-}
-
-const float epsilon = 1;
+static const float epsilon = 1;
 
-float max(float a, float b) { return a < b ? b : a; }
+static float max(float a, float b) { return a < b ? b : a; }
 
-float flatness(float x0, float y0, float x1, float y1, float x2, float y2,
-               float x3, float y3) {
+static float flatness(float x0, float y0, float x1, float y1, float x2,
+                      float y2, float x3, float y3) {
   float ux = 3.0 * x1 - 2.0 * x0 - x3;
   float uy = 3.0 * y1 - 2.0 * y0 - y3;
   float vx = 3.0 * x2 - 2.0 * x3 - x0;
@@ -188,9 +259,9 @@ float flatness(float x0, float y0, float x1, float y1, float x2, float y2,
   return max(ux * ux, vx * vx) + max(uy * uy, vy * vy);
 }
 
-void approx_bezier(context *ctx, float x0, float y0, float x1, float y1,
-                   float x2, float y2, float x3, float y3) {
-  if (flatness(x0, y0, x1, y1, x2, y2, x3, y3) < epsilon) {
+static void approx_bezier(context *ctx, float x0, float y0, float x1,
+                          float y1, float x2, float y2, float x3, float y3) {
+  if (flatness(x0, y0, x1, y1, x2, y2, x3, y3) < ctx->tolerance) {
     add_to_path(ctx, x3, y3);
     return;
   }
@@ -213,67 +284,897 @@ void approx_bezier(context *ctx, float x0, float y0, float x1, float y1,
   approx_bezier(ctx, x0123, y0123, x123, y123, x23, y23, x3, y3);
 }
 
-void emit_line_segment(context *ctx, point a, point b) {
+typedef float v4 __attribute__((vector_size(16)));
+
+static v4 load4(const float *p) {
+  v4 v;
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+// A path's cubics in structure-of-arrays form, four to a group, the samples
+// of the group being flattened and the points the curves flatten to.
+typedef struct curve_batch {
+  float *p[8];
+  int *n, *offset;
+  int capacity;
+  float *s[4];
+  int n_samples;
+  float *x, *y;
+  int n_points;
+} curve_batch;
+
+static void reserve_curves(curve_batch *b, int n) {
+  if (n <= b->capacity) return;
+  b->capacity = 2 * n;
+  for (int i = 0; i < 8; ++i) {
+    b->p[i] = realloc(b->p[i], b->capacity * sizeof(float));
+    if (!b->p[i]) exit(1);
+  }
+  b->n = realloc(b->n, b->capacity * sizeof(int));
+  b->offset = realloc(b->offset, b->capacity * sizeof(int));
+  if (!b->n || !b->offset) exit(1);
+}
+
+// The flatness test of approx_bezier for the piece of a curve between samples
+// a and b, h apart in t. The piece's inner control points are P(a) + hP'(a)/3
+// and P(b) - hP'(b)/3, so the test needs only the samples and derivatives.
+static int flat_between(float *s[4], int a, int b, float h, float tolerance) {
+  float ux = s[0][a] + h * s[2][a] - s[0][b];
+  float uy = s[1][a] + h * s[3][a] - s[1][b];
+  float vx = s[0][b] - h * s[2][b] - s[0][a];
+  float vy = s[1][b] - h * s[3][b] - s[1][a];
+  return max(ux * ux, vx * vx) + max(uy * uy, vy * vy) < tolerance;
+}
+
+// Samples each curve and its derivative at a power-of-two number of uniform
+// steps, four curves per iteration in power form, then walks the samples in
+// the order approx_bezier splits the curve, keeping the points it would keep.
+// The step count comes from Wang's formula at a distance of
+// sqrt(tolerance / 2) / 4, within which a single step always passes the test.
+static void flatten_batch(curve_batch *b, int m, float tolerance) {
+  float d = sqrtf(tolerance) / (4 * sqrtf(2));
+  int total = 0;
+  for (int g = 0; g < m; g += 4) {
+    v4 x0 = load4(b->p[0] + g), y0 = load4(b->p[1] + g);
+    v4 x1 = load4(b->p[2] + g), y1 = load4(b->p[3] + g);
+    v4 x2 = load4(b->p[4] + g), y2 = load4(b->p[5] + g);
+    v4 x3 = load4(b->p[6] + g), y3 = load4(b->p[7] + g);
+    v4 ux = x0 - 2 * x1 + x2, uy = y0 - 2 * y1 + y2;
+    v4 vx = x1 - 2 * x2 + x3, vy = y1 - 2 * y2 + y3;
+    v4 u = ux * ux + uy * uy, v = vx * vx + vy * vy;
+    for (int j = 0; j < 4 && g + j < m; ++j) {
+      float k = sqrtf(0.75f * sqrtf(max(u[j], v[j])) / d);
+      int n = 1;
+      while (n < k && n < 65536) n *= 2;
+      b->n[g + j] = n;
+      b->offset[g + j] = total;
+      total += n - 1;
+    }
+  }
+
+  if (total > b->n_points) {
+    b->n_points = 2 * total;
+    b->x = realloc(b->x, b->n_points * sizeof(float));
+    b->y = realloc(b->y, b->n_points * sizeof(float));
+    if (!b->x || !b->y) exit(1);
+  }
+
+  for (int g = 0; g < m; g += 4) {
+    v4 x0 = load4(b->p[0] + g), y0 = load4(b->p[1] + g);
+    v4 x1 = load4(b->p[2] + g), y1 = load4(b->p[3] + g);
+    v4 x2 = load4(b->p[4] + g), y2 = load4(b->p[5] + g);
+    v4 x3 = load4(b->p[6] + g), y3 = load4(b->p[7] + g);
+    v4 ax = x3 - x0 + 3 * (x1 - x2), ay = y3 - y0 + 3 * (y1 - y2);
+    v4 bx = 3 * (x0 - 2 * x1 + x2), by = 3 * (y0 - 2 * y1 + y2);
+    v4 cx = 3 * (x1 - x0), cy = 3 * (y1 - y0);
+
+    int lanes = m - g < 4 ? m - g : 4, steps = 0;
+    v4 dt = {1, 1, 1, 1};
+    for (int j = 0; j < lanes; ++j) {
+      dt[j] = 1.0f / b->n[g + j];
+      if (b->n[g + j] > steps) steps = b->n[g + j];
+    }
+
+    if (4 * (steps + 1) > b->n_samples) {
+      b->n_samples = 8 * (steps + 1);
+      for (int c = 0; c < 4; ++c) {
+        b->s[c] = realloc(b->s[c], b->n_samples * sizeof(float));
+        if (!b->s[c]) exit(1);
+      }
+    }
+    for (int k = 0; k <= steps; ++k) {
+      v4 t = (float)k * dt;
+      v4 x = ((ax * t + bx) * t + cx) * t + x0;
+      v4 y = ((ay * t + by) * t + cy) * t + y0;
+      v4 dx = (3 * ax * t + 2 * bx) * t + cx;
+      v4 dy = (3 * ay * t + 2 * by) * t + cy;
+      memcpy(b->s[0] + 4 * k, &x, sizeof(v4));
+      memcpy(b->s[1] + 4 * k, &y, sizeof(v4));
+      memcpy(b->s[2] + 4 * k, &dx, sizeof(v4));
+      memcpy(b->s[3] + 4 * k, &dy, sizeof(v4));
+    }
+
+    // After a piece is kept the next one tested is its right sibling, or
+    // that of the nearest ancestor it closes, which starts at i and spans
+    // i's lowest set bit.
+    for (int j = 0; j < lanes; ++j) {
+      int n = b->n[g + j], kept = 0;
+      float *x = b->x + b->offset[g + j], *y = b->y + b->offset[g + j];
+      for (int i = 0; i < n;) {
+        int step = i ? i & -i : n;
+        while (step > 1 && !flat_between(b->s, 4 * i + j, 4 * (i + step) + j,
+                                         dt[j] * step, tolerance)) {
+          step /= 2;
+        }
+        i += step;
+        if (i == n) break;
+        x[kept] = b->s[0][4 * i + j];
+        y[kept] = b->s[1][4 * i + j];
+        ++kept;
+      }
+      b->n[g + j] = kept + 1;
+    }
+  }
+}
+
+// Set by --batch. The points match the recursive subdivision's only up to
+// rounding, so the recursive one stays the default.
+int batched;
+
+// Curves are recorded as their end vertex and flattened only when painted,
+// so the whole path can be handed to a worker. A move_to that lands on a
+// curve end replaces the last flattened point, as it did when curves were
+// flattened on the spot; the end vertex itself becomes that point.
+static void flatten_path(context *ctx) {
+  static _Thread_local curve_batch batch;
+  curve_batch *b = &batch;
+
+  int m = 0;
+  for (vertex *v = ctx->path.head; v; v = v->next) m += v->curve;
+  if (!m) return;
+
+  path curves = ctx->path;
+  ctx->path.head = ctx->path.tail = NULL;
+
+  if (batched) {
+    reserve_curves(b, m + 3);
+    int i = 0;
+    point p = {0, 0};
+    for (vertex *v = curves.head; v; p = v->pos, v = v->next) {
+      if (!v->curve) continue;
+      float c[8] = {p.x,     p.y,     v->c1.x, v->c1.y,
+                    v->c2.x, v->c2.y, v->c3.x, v->c3.y};
+      for (int k = 0; k < 8; ++k) b->p[k][i] = c[k];
+      ++i;
+    }
+    for (; i % 4; ++i) {
+      for (int k = 0; k < 8; ++k) b->p[k][i] = 0;
+    }
+    flatten_batch(b, m, ctx->tolerance);
+  }
+
+  vertex *next;
+  int i = 0;
+  for (vertex *v = curves.head; v; v = next) {
+    next = v->next;
+    v->next = NULL;
+    if (v->curve && !batched) {
+      point p = ctx->path.tail->pos;
+      approx_bezier(ctx, p.x, p.y, v->c1.x, v->c1.y, v->c2.x, v->c2.y,
+                    v->c3.x, v->c3.y);
+      ctx->path.tail->pos = v->pos;
+      free(v);
+      continue;
+    }
+    if (v->curve) {
+      for (int k = 0; k < b->n[i] - 1; ++k) {
+        add_to_path(ctx, b->x[b->offset[i] + k], b->y[b->offset[i] + k]);
+      }
+      v->curve = 0;
+      ++i;
+    }
+    if (!ctx->path.head)
+      ctx->path.head = ctx->path.tail = v;
+    else
+      ctx->path.tail = ctx->path.tail->next = v;
+  }
+}
+
+// Ellipses are flattened on the spot with enough segments to keep each
+// chord within an eighth of a device pixel of the arc.
+static void add_ellipse(context *ctx, float cx, float cy, float rx, float ry) {
+  mat3 m = get_transform(ctx);
+  float sx = sqrtf(m.v[0][0] * m.v[0][0] + m.v[1][0] * m.v[1][0]);
+  float sy = sqrtf(m.v[0][1] * m.v[0][1] + m.v[1][1] * m.v[1][1]);
+  float r = max(rx * sx, ry * sy) / sqrtf(ctx->tolerance);
+
+  int n = 8;
+  if (r > 0.125f) n = max(n, ceilf(M_PI / acosf(1 - 0.125f / r)));
+  if (n > 4096) n = 4096;
+
+  reset_path(ctx);
+  *current_point(ctx) = (point){cx + rx, cy};
+  for (int i = 1; i < n; ++i) {
+    float theta = (2 * M_PI / n) * i;
+    add_to_path(ctx, cx + rx * cosf(theta), cy + ry * sinf(theta));
+  }
+  add_to_path(ctx, cx + rx, cy);
+}
+
+// A color that is not opaque carries its alpha in the top byte.
+static int with_alpha(int color, float alpha) {
+  unsigned a = (unsigned)color >> 24;
+  a = lrintf((a ? a : 255) * alpha);
+  if (a >= 255) return color & 0xffffff;
+  return (color & 0xffffff) | (a ? a : 1) << 24;
+}
+
+static void begin_polygon(context *ctx, int color, int n) {
+  fprintf(ctx->out, "%#x %d\n", color, n);
+  if (ctx->bounds) ++ctx->bounds->polygons;
+}
+
+static void put_vertex(context *ctx, float x, float y) {
+  fprintf(ctx->out, "%f %f\n", x, y);
+  bounds *b = ctx->bounds;
+  if (!b) return;
+  if (x < b->box[0]) b->box[0] = x;
+  if (y < b->box[1]) b->box[1] = y;
+  if (x > b->box[2]) b->box[2] = x;
+  if (y > b->box[3]) b->box[3] = y;
+}
+
+static void emit_line_segment(context *ctx, point a, point b) {
   float r = ctx->style->stroke_width / 2;
   float vx = b.x - a.x, vy = b.y - a.y;
   float l = sqrtf(vx * vx + vy * vy);
   if (l == 0) return;
   float dx = -r * (vy / l), dy = r * (vx / l);
-  printf("%#x %d\n", ctx->style->stroke_color, 4);
-  printf("%f %f\n", a.x + dx, a.y + dy);
-  printf("%f %f\n", a.x - dx, a.y - dy);
-  printf("%f %f\n", b.x - dx, b.y - dy);
-  printf("%f %f\n", b.x + dx, b.y + dy);
+  begin_polygon(ctx, ctx->style->stroke_color, 4);
+  put_vertex(ctx, a.x + dx, a.y + dy);
+  put_vertex(ctx, a.x - dx, a.y - dy);
+  put_vertex(ctx, b.x - dx, b.y - dy);
+  put_vertex(ctx, b.x + dx, b.y + dy);
 }
 
-void emit_line_joint(context *ctx, point p) {
+static void emit_line_joint(context *ctx, point p) {
   int n = 10;
   float r = ctx->style->stroke_width / 2;
 
-  printf("%#x %d\n", ctx->style->stroke_color, n);
+  begin_polygon(ctx, ctx->style->stroke_color, n);
   for (int i = 0; i < n; ++i) {
     float theta = (2 * M_PI / n) * i;
-    printf("%f %f\n", p.x + r * cosf(theta), p.y + r * sinf(theta));
+    put_vertex(ctx, p.x + r * cosf(theta), p.y + r * sinf(theta));
   }
 }
 
-void apply_transform(context *ctx) {
-  mat3 m = get_transform(ctx);
+static void apply_transform(context *ctx, mat3 m) {
   for (vertex *v = ctx->path.head; v; v = v->next) {
     v->pos = to_point(apply(m, to_vec(v->pos)));
   }
 }
 
-void fill_path(context *ctx) {
-  if (!ctx->style) exit(1);
-  if (ctx->style->fill_color == -1) return;
+static float segment_dist2(point p, point a, point b) {
+  float vx = b.x - a.x, vy = b.y - a.y, wx = p.x - a.x, wy = p.y - a.y;
+  float l = vx * vx + vy * vy;
+  float t = l > 0 ? (wx * vx + wy * vy) / l : 0;
+  if (t < 0) t = 0;
+  if (t > 1) t = 1;
+  float dx = wx - t * vx, dy = wy - t * vy;
+  return dx * dx + dy * dy;
+}
 
-  int n = size(&ctx->path);
-  if (n >= 2) {
-    printf("%#x %d\n", ctx->style->fill_color, n);
-    for (vertex *v = ctx->path.head; v; v = v->next) {
-      printf("%f %f\n", v->pos.x, v->pos.y);
+// Error bound in device pixels; 0 turns simplification off.
+float simplify = 0.02f;
+
+#define MAX_SKIPPED 16
+
+// Marks vertices that lie within eps of the segment that replaces them:
+// collinear runs and sub-pixel wiggles. Each candidate segment is checked
+// against every vertex it would replace, so the error never accumulates.
+// The first and last vertices are always kept. Only the fill skips marked
+// vertices: stroke pieces overlap at every joint, and dropping joints would
+// change the anti-aliased coverage along the stroke. Returns how many were
+// marked.
+static int simplify_path(context *ctx, float eps) {
+  vertex *anchor = ctx->path.head;
+  if (!anchor) return 0;
+
+  vertex *skipped[MAX_SKIPPED];
+  int n = 0, removed = 0;
+  float eps2 = eps * eps;
+  for (vertex *v = anchor->next; v && v->next; v = v->next) {
+    vertex *c = v->next;
+    int fits = n < MAX_SKIPPED;
+    for (int i = 0; fits && i < n; ++i) {
+      fits = segment_dist2(skipped[i]->pos, anchor->pos, c->pos) <= eps2;
+    }
+    if (fits) fits = segment_dist2(v->pos, anchor->pos, c->pos) <= eps2;
+    if (fits) {
+      skipped[n++] = v;
+    } else {
+      for (int i = 0; i < n; ++i) skipped[i]->dropped = 1;
+      removed += n;
+      anchor = v;
+      n = 0;
     }
   }
+  for (int i = 0; i < n; ++i) skipped[i]->dropped = 1;
+  return removed + n;
+}
+
+// Returns whether a polygon was written.
+static int fill_path(context *ctx) {
+  if (!ctx->style) exit(1);
+  if (ctx->style->fill_color == -1) return 0;
+  if (ctx->style->fill_opacity <= 0) return 0;
+
+  int n = 0;
+  for (vertex *v = ctx->path.head; v; v = v->next) n += !v->dropped;
+  if (n < 2) return 0;
+  int color = ctx->style->fill_color;
+  if (ctx->style->fill_opacity < 1) {
+    color = with_alpha(color, ctx->style->fill_opacity);
+  }
+  begin_polygon(ctx, color, n);
+  for (vertex *v = ctx->path.head; v; v = v->next) {
+    if (!v->dropped) put_vertex(ctx, v->pos.x, v->pos.y);
+  }
+  return 1;
 }
 
-void stroke_path(context *ctx) {
+// The pieces of a stroke overlap, so a translucent stroke is drawn opaque
+// into a layer of its own and blended in as a whole.
+static void stroke_path(context *ctx) {
   if (!ctx->style) exit(1);
   if (ctx->style->stroke_color == -1) return;
   if (ctx->style->stroke_width <= 0) return;
+  if (ctx->style->stroke_opacity <= 0) return;
   if (size(&ctx->path) < 2) return;
 
+  float alpha = ctx->style->stroke_opacity;
+  if (alpha < 1) {
+    float r = ctx->style->stroke_width / 2;
+    float box[4] = {INFINITY, INFINITY, -INFINITY, -INFINITY};
+    for (vertex *v = ctx->path.head; v; v = v->next) {
+      if (v->pos.x < box[0]) box[0] = v->pos.x;
+      if (v->pos.y < box[1]) box[1] = v->pos.y;
+      if (v->pos.x > box[2]) box[2] = v->pos.x;
+      if (v->pos.y > box[3]) box[3] = v->pos.y;
+    }
+    fprintf(ctx->out, "push layer %g %f %f %f %f\n", alpha, box[0] - r,
+            box[1] - r, box[2] + r, box[3] + r);
+    if (ctx->bounds) ctx->bounds->nested = 1;
+  }
   for (vertex *v = ctx->path.head; v != ctx->path.tail; v = v->next) {
     emit_line_segment(ctx, v->pos, v->next->pos);
   }
   for (vertex *v = ctx->path.head; v; v = v->next) {
     emit_line_joint(ctx, v->pos);
   }
+  if (alpha < 1) fprintf(ctx->out, "pop layer\n");
+}
+
+// Returns the number of vertices simplification removed.
+static int paint_path(context *ctx, mat3 *m) {
+  enter_phase(phase_flatten);
+  flatten_path(ctx);
+  leave_phase();
+  if (m) apply_transform(ctx, *m);
+  int removed = 0;
+  if (simplify && ctx->style->fill_color != -1) {
+    removed = simplify_path(ctx, simplify * sqrtf(ctx->tolerance));
+  }
+  fill_path(ctx);
+  enter_phase(phase_stroke);
+  stroke_path(ctx);
+  leave_phase();
+  return removed;
+}
+
+static int n_threads = 1;
+
+#define PAINT_WINDOW 256
+
+typedef struct paint_job {
+  style style;
+  mat3 matrix;
+  int transformed;
+  path path;
+  char *buffer;
+  size_t size;
+  int kind;
+  float alpha;
+  bounds bounds;
+  int done;
+} paint_job;
+
+enum { job_paint, job_text, job_open_layer, job_close_layer };
+
+// Paths are painted by workers into their own buffers; the interpreting
+// thread writes the buffers out in paint order, and opens and closes layers
+// as it meets them.
+typedef struct paint_queue {
+  paint_job jobs[PAINT_WINDOW];
+  long produced, claimed, written;
+  int closing;
+  float tolerance;
+  FILE *out;
+  layer *layer;
+  pthread_mutex_t lock;
+  pthread_cond_t ready, finished;
+} paint_queue;
+
+static void *paint_worker(void *arg) {
+  paint_queue *q = arg;
+  pthread_mutex_lock(&q->lock);
+  for (;;) {
+    // Jobs queued already done can be written out before any worker reaches
+    // them, and their slots reused, so nothing below written is claimed.
+    if (q->claimed < q->written) q->claimed = q->written;
+    if (q->claimed == q->produced) {
+      if (q->closing) break;
+      pthread_cond_wait(&q->ready, &q->lock);
+      continue;
+    }
+    paint_job *j = &q->jobs[q->claimed++ % PAINT_WINDOW];
+    if (j->kind != job_paint) continue;
+    pthread_mutex_unlock(&q->lock);
+
+    context ctx = {.style = &j->style, .path = j->path};
+    ctx.tolerance = q->tolerance;
+    j->bounds = no_bounds;
+    ctx.bounds = &j->bounds;
+    ctx.out = open_memstream(&j->buffer, &j->size);
+    count(count_simplified,
+          paint_path(&ctx, j->transformed ? &j->matrix : NULL));
+    fclose(ctx.out);
+    clear(&ctx.path);
+
+    pthread_mutex_lock(&q->lock);
+    j->done = 1;
+    pthread_cond_broadcast(&q->finished);
+  }
+  pthread_mutex_unlock(&q->lock);
+  return NULL;
+}
+
+static void open_layer(layer **top, FILE **out, float alpha) {
+  layer *l = calloc(1, sizeof(layer));
+  if (!l) exit(1);
+  l->alpha = alpha;
+  l->bounds = no_bounds;
+  l->out = open_memstream(&l->text, &l->size);
+  if (!l->out) exit(1);
+  l->below = *out;
+  l->parent = *top;
+  *top = l;
+  *out = l->out;
+}
+
+// A group goes out as "push layer A x0 y0 x1 y1", its content and "pop
+// layer". An empty group is dropped, and one that is a single polygon just
+// takes on the group's alpha.
+static void close_layer(layer **top, FILE **out) {
+  layer *l = *top;
+  if (!l) exit(1);
+  fclose(l->out);
+  *top = l->parent;
+  *out = l->below;
+
+  bounds *b = &l->bounds;
+  if (b->polygons == 1 && !b->nested) {
+    int color, n, skip = 0;
+    sscanf(l->text, "%x %d\n%n", &color, &n, &skip);
+    fprintf(*out, "%#x %d\n", with_alpha(color, l->alpha), n);
+    fwrite(l->text + skip, 1, l->size - skip, *out);
+  } else if (b->polygons) {
+    fprintf(*out, "push layer %g %f %f %f %f\n", l->alpha, b->box[0],
+            b->box[1], b->box[2], b->box[3]);
+    fwrite(l->text, 1, l->size, *out);
+    fprintf(*out, "pop layer\n");
+    b->nested = 1;
+  }
+  if (*top) add_bounds(&(*top)->bounds, b);
+  free(l->text);
+  free(l);
+}
+
+// Called with the lock held. Writes finished jobs in order, waiting for
+// unfinished ones until at most `pending` remain.
+static void write_painted(paint_queue *q, long pending) {
+  while (q->produced - q->written > pending) {
+    paint_job *j = &q->jobs[q->written % PAINT_WINDOW];
+    if (!j->done) {
+      pthread_cond_wait(&q->finished, &q->lock);
+      continue;
+    }
+    pthread_mutex_unlock(&q->lock);
+    if (j->kind == job_open_layer) {
+      open_layer(&q->layer, &q->out, j->alpha);
+    } else if (j->kind == job_close_layer) {
+      close_layer(&q->layer, &q->out);
+    } else {
+      fwrite(j->buffer, 1, j->size, q->out);
+      free(j->buffer);
+      if (q->layer) add_bounds(&q->layer->bounds, &j->bounds);
+    }
+    pthread_mutex_lock(&q->lock);
+    ++q->written;
+  }
+}
+
+static void queue_paint(context *ctx) {
+  paint_queue *q = ctx->queue;
+  pthread_mutex_lock(&q->lock);
+  write_painted(q, PAINT_WINDOW - 1);
+
+  paint_job *j = &q->jobs[q->produced % PAINT_WINDOW];
+  j->style = *ctx->style;
+  j->style.parent = NULL;
+  j->transformed = ctx->transforms != NULL;
+  if (j->transformed) j->matrix = get_transform(ctx);
+  j->path = ctx->path;
+  j->kind = job_paint;
+  j->done = 0;
+  ctx->path.head = ctx->path.tail = NULL;
+
+  ++q->produced;
+  pthread_cond_signal(&q->ready);
+  pthread_mutex_unlock(&q->lock);
+}
+
+// Queues a job that is already done, for `text` (malloced, and freed once
+// written) or a layer boundary.
+static void queue_done(paint_queue *q, int kind, char *text, size_t size,
+                       float alpha) {
+  pthread_mutex_lock(&q->lock);
+  write_painted(q, PAINT_WINDOW - 1);
+  paint_job *j = &q->jobs[q->produced % PAINT_WINDOW];
+  j->buffer = text;
+  j->size = size;
+  j->kind = kind;
+  j->alpha = alpha;
+  j->bounds = no_bounds;
+  j->bounds.nested = 1;
+  j->done = 1;
+  ++q->produced;
+  pthread_cond_signal(&q->ready);
+  pthread_mutex_unlock(&q->lock);
+}
+
+// Writes `text` (malloced, and freed here) in paint order.
+static void write_text(context *ctx, char *text, size_t size) {
+  if (ctx->queue) {
+    queue_done(ctx->queue, job_text, text, size, 0);
+    return;
+  }
+  fwrite(text, 1, size, ctx->out);
+  free(text);
+  if (ctx->bounds) ctx->bounds->nested = 1;
+}
+
+// A definition's paths after flattening, recorded for one flattening
+// tolerance. Styles are resolved against the use site when drawn.
+// op is fill_and_stroke for a path, or the clip or layer command recorded in
+// its place, with the layer's opacity in alpha.
+typedef struct cached_path {
+  cmd_type op;
+  float alpha;
+  style style;
+  mat3 matrix;
+  int transformed;
+  point *points;
+  int n;
+} cached_path;
+
+typedef struct symbol_cache {
+  float tolerance;
+  cached_path *paths;
+  int n_paths, capacity;
+  struct symbol_cache *next;
+} symbol_cache;
+
+typedef struct symbol {
+  char *text;
+  size_t size;
+  int recording;
+  symbol_cache *cache;
+} symbol;
+
+typedef struct symbol_table {
+  symbol *v;
+  int n;
+} symbol_table;
+
+static void record_path(context *ctx) {
+  enter_phase(phase_flatten);
+  flatten_path(ctx);
+  leave_phase();
+
+  symbol_cache *c = ctx->recording;
+  if (c->n_paths == c->capacity) {
+    c->capacity = c->capacity ? 2 * c->capacity : 16;
+    c->paths = realloc(c->paths, c->capacity * sizeof(cached_path));
+    if (!c->paths) exit(1);
+  }
+  cached_path *p = &c->paths[c->n_paths++];
+  p->op = fill_and_stroke;
+  p->style = *ctx->style;
+  p->style.parent = NULL;
+  p->transformed = ctx->transforms != NULL;
+  if (p->transformed) p->matrix = get_transform(ctx);
+  p->n = size(&ctx->path);
+  p->points = malloc(p->n * sizeof(point));
+  if (p->n && !p->points) exit(1);
+  int i = 0;
+  for (vertex *v = ctx->path.head; v; v = v->next) p->points[i++] = v->pos;
+}
+
+// Clip geometry keeps only its outline: it is flattened and transformed like
+// any path but filled without simplification, so rectangles stay exact.
+static void paint_clip(context *ctx) {
+  enter_phase(phase_flatten);
+  flatten_path(ctx);
+  leave_phase();
+  if (ctx->transforms) apply_transform(ctx, get_transform(ctx));
+
+  style *saved = ctx->style;
+  style s = {.fill_color = 0, .stroke_color = -1, .fill_opacity = 1};
+  FILE *out = ctx->out;
+  bounds *b = ctx->bounds;
+  ctx->style = &s;
+  ctx->out = ctx->clip;
+  ctx->bounds = NULL;
+  ctx->clip_polygons += fill_path(ctx);
+  ctx->style = saved;
+  ctx->out = out;
+  ctx->bounds = b;
+}
+
+static void paint(context *ctx) {
+  if (ctx->recording) {
+    record_path(ctx);
+  } else if (ctx->clip) {
+    paint_clip(ctx);
+  } else if (ctx->queue) {
+    queue_paint(ctx);
+  } else if (ctx->transforms) {
+    mat3 m = get_transform(ctx);
+    count(count_simplified, paint_path(ctx, &m));
+  } else {
+    count(count_simplified, paint_path(ctx, NULL));
+  }
+}
+
+static float scale_of(mat3 m) {
+  float sx = sqrtf(m.v[0][0] * m.v[0][0] + m.v[1][0] * m.v[1][0]);
+  float sy = sqrtf(m.v[0][1] * m.v[0][1] + m.v[1][1] * m.v[1][1]);
+  return max(sx, sy);
+}
+
+// Curves are flattened with a tolerance for the path's own coordinates, so a
+// use that magnifies its content needs a finer one. The scale is taken
+// relative to the viewBox transform, which the document tolerance already
+// covers. Uses are grouped into power-of-two bands of it, with a little slack
+// for rounding in rotations; scales up to 1 keep the document tolerance.
+static float use_tolerance(context *ctx) {
+  float k = scale_of(get_transform(ctx));
+  if (ctx->document) k /= scale_of(ctx->document->matrix);
+  int e;
+  frexpf(k * (1 - 1.0f / 1024), &e);
+  if (e < 0) e = 0;
+  if (e > 16) e = 16;
+  return ldexpf(ctx->tolerance, -2 * e);
+}
+
+static void record_command(context *ctx, cmd_type type, float alpha) {
+  symbol_cache *c = ctx->recording;
+  if (c->n_paths == c->capacity) {
+    c->capacity = c->capacity ? 2 * c->capacity : 16;
+    c->paths = realloc(c->paths, c->capacity * sizeof(cached_path));
+    if (!c->paths) exit(1);
+  }
+  c->paths[c->n_paths++] = (cached_path){.op = type, .alpha = alpha};
+}
+
+// A clip goes out as "push clip N" followed by its N polygons, ahead of the
+// content it clips, and "pop clip" after it. Clips met while a clip's own
+// geometry is being painted only add their geometry to it.
+static void clip_command(context *ctx, cmd_type type) {
+  if (ctx->recording) {
+    record_command(ctx, type, 0);
+    return;
+  }
+
+  switch (type) {
+    case begin_clip:
+      if (ctx->clip) {
+        ++ctx->clip_nested;
+        break;
+      }
+      ctx->clip = open_memstream(&ctx->clip_text, &ctx->clip_size);
+      if (!ctx->clip) exit(1);
+      ctx->clip_polygons = 0;
+      break;
+    case end_clip: {
+      if (!ctx->clip) exit(1);
+      if (ctx->clip_nested) break;
+      fclose(ctx->clip);
+      ctx->clip = NULL;
+      char *text;
+      size_t size;
+      FILE *f = open_memstream(&text, &size);
+      if (!f) exit(1);
+      fprintf(f, "push clip %d\n", ctx->clip_polygons);
+      fwrite(ctx->clip_text, 1, ctx->clip_size, f);
+      fclose(f);
+      free(ctx->clip_text);
+      write_text(ctx, text, size);
+      break;
+    }
+    case pop_clip:
+      if (ctx->clip_nested) {
+        --ctx->clip_nested;
+        break;
+      }
+      write_text(ctx, strdup("pop clip\n"), strlen("pop clip\n"));
+      break;
+    default:
+      break;
+  }
+}
+
+// Opacity does not matter to clip geometry, so layers met while painting it
+// are ignored.
+static void layer_command(context *ctx, cmd_type type, float alpha) {
+  if (ctx->recording) {
+    record_command(ctx, type, alpha);
+  } else if (ctx->clip) {
+    return;
+  } else if (ctx->queue) {
+    queue_done(ctx->queue,
+               type == begin_layer ? job_open_layer : job_close_layer, NULL,
+               0, alpha);
+  } else {
+    if (type == begin_layer) {
+      open_layer(&ctx->layer, &ctx->out, alpha);
+    } else {
+      close_layer(&ctx->layer, &ctx->out);
+    }
+    ctx->bounds = ctx->layer ? &ctx->layer->bounds : NULL;
+  }
 }
 
-int exec_next_command(context *ctx) {
+static void free_styles(context *ctx) {
+  while (ctx->style) {
+    style *s = ctx->style;
+    ctx->style = s->parent;
+    free(s);
+  }
+}
+
+static int exec_next_command(context *ctx);
+
+// Runs the definition once for a tolerance, keeping the flattened paths
+// instead of painting them.
+static symbol_cache *record_symbol(context *ctx, symbol *s, float tolerance) {
+  if (s->recording) exit(1);
+  s->recording = 1;
+
+  symbol_cache *c = calloc(1, sizeof(symbol_cache));
+  if (!c) exit(1);
+  c->tolerance = tolerance;
+
+  context r = {.tolerance = tolerance, .symbols = ctx->symbols, .recording = c};
+  r.style = calloc(1, sizeof(style));
+  if (!r.style) exit(1);
+  r.style->fill_color = 0;
+  r.style->stroke_color = -1;
+  r.style->stroke_width = 1;
+  r.style->fill_opacity = 1;
+  r.style->stroke_opacity = 1;
+  r.in = fmemopen(s->text, s->size, "r");
+  if (!r.in) exit(1);
+  while (exec_next_command(&r));
+  fclose(r.in);
+  clear(&r.path);
+  while (r.transforms) pop_transform(&r);
+  free_styles(&r);
+
+  c->next = s->cache;
+  s->cache = c;
+  s->recording = 0;
+  count(count_symbols, 1);
+  return c;
+}
+
+// Each cached path is painted under the use site's matrix, so only the
+// transform, simplification and stroking run per instance.
+static void draw_symbol(context *ctx, int id) {
+  if (!ctx->symbols || id < 0 || id >= ctx->symbols->n) exit(1);
+  symbol *s = &ctx->symbols->v[id];
+  if (!s->text) exit(1);
+
+  float tolerance = use_tolerance(ctx);
+  symbol_cache *c = s->cache;
+  while (c && c->tolerance != tolerance) c = c->next;
+  if (!c) c = record_symbol(ctx, s, tolerance);
+  count(count_instances, 1);
+
+  style *saved = ctx->style;
+  for (int i = 0; i < c->n_paths; ++i) {
+    cached_path *p = &c->paths[i];
+    if (p->op == begin_layer || p->op == end_layer) {
+      layer_command(ctx, p->op, p->alpha);
+      continue;
+    }
+    if (p->op != fill_and_stroke) {
+      clip_command(ctx, p->op);
+      continue;
+    }
+    style current = *saved;
+    current.parent = NULL;
+    if (p->style.set & set_fill) current.fill_color = p->style.fill_color;
+    if (p->style.set & set_stroke) current.stroke_color = p->style.stroke_color;
+    if (p->style.set & set_width) current.stroke_width = p->style.stroke_width;
+    if (p->style.set & set_fill_opacity) {
+      current.fill_opacity = p->style.fill_opacity;
+    }
+    if (p->style.set & set_stroke_opacity) {
+      current.stroke_opacity = p->style.stroke_opacity;
+    }
+    current.set |= p->style.set;
+    ctx->style = &current;
+    if (p->transformed) push_transform(ctx, p->matrix);
+    clear(&ctx->path);
+    for (int k = 0; k < p->n; ++k) {
+      add_to_path(ctx, p->points[k].x, p->points[k].y);
+    }
+    paint(ctx);
+    if (p->transformed) pop_transform(ctx);
+  }
+  ctx->style = saved;
+  clear(&ctx->path);
+}
+
+static void define_symbol(context *ctx, int id, size_t n) {
+  symbol_table *t = ctx->symbols;
+  if (!t || id < 0) exit(1);
+  if (id >= t->n) {
+    t->v = realloc(t->v, (id + 1) * sizeof(symbol));
+    if (!t->v) exit(1);
+    memset(t->v + t->n, 0, (id + 1 - t->n) * sizeof(symbol));
+    t->n = id + 1;
+  }
+  symbol *s = &t->v[id];
+  if (s->text) exit(1);
+  s->text = malloc(n + 1);
+  if (!s->text || fread(s->text, 1, n, ctx->in) != n) exit(1);
+  s->size = n;
+}
+
+static void free_symbols(symbol_table *t) {
+  for (int i = 0; i < t->n; ++i) {
+    symbol_cache *next;
+    for (symbol_cache *c = t->v[i].cache; c; c = next) {
+      next = c->next;
+      for (int k = 0; k < c->n_paths; ++k) free(c->paths[k].points);
+      free(c->paths);
+      free(c);
+    }
+    free(t->v[i].text);
+  }
+  free(t->v);
+}
+
+static int exec_next_command(context *ctx) {
   cmd_type type;
-  if (scanf("%d%*[^\n]\n", &type) == EOF) return 0;
+  if (fscanf(ctx->in, "%d%*[^\n]\n", &type) == EOF) return 0;
+  count(count_commands, 1);
+  int after_canvas = ctx->canvas;
+  ctx->canvas = 0;
 
   switch (type) {
     case save:
@@ -283,20 +1184,34 @@ int exec_next_command(context *ctx) {
       restore_style(ctx);
       break;
     case stroke_width:
-      scanf("%f\n", &ctx->style->stroke_width);
+      fscanf(ctx->in, "%f\n", &ctx->style->stroke_width);
+      ctx->style->set |= set_width;
       break;
     case stroke_color:
-      scanf("%x\n", &ctx->style->stroke_color);
+      fscanf(ctx->in, "%x\n", &ctx->style->stroke_color);
+      ctx->style->set |= set_stroke;
       break;
     case fill_color:
-      scanf("%x\n", &ctx->style->fill_color);
+      fscanf(ctx->in, "%x\n", &ctx->style->fill_color);
+      ctx->style->set |= set_fill;
+      break;
+    case fill_opacity:
+      fscanf(ctx->in, "%f\n", &ctx->style->fill_opacity);
+      ctx->style->set |= set_fill_opacity;
+      break;
+    case stroke_opacity:
+      fscanf(ctx->in, "%f\n", &ctx->style->stroke_opacity);
+      ctx->style->set |= set_stroke_opacity;
       break;
     case push_matrix: {
       mat3 m = {0};
-      scanf("%f %f %f %f %f %f\n", &m.v[0][0], &m.v[1][0], &m.v[0][1],
-            &m.v[1][1], &m.v[0][2], &m.v[1][2]);
+      fscanf(ctx->in, "%f %f %f %f %f %f\n", &m.v[0][0], &m.v[1][0],
+             &m.v[0][1], &m.v[1][1], &m.v[0][2], &m.v[1][2]);
       m.v[2][2] = 1.0f;
       push_transform(ctx, m);
+      if (after_canvas && !ctx->transforms->parent) {
+        ctx->document = ctx->transforms;
+      }
       break;
     }
     case pop_matrix:
@@ -307,7 +1222,7 @@ int exec_next_command(context *ctx) {
       break;
     case move_to: {
       float x, y;
-      scanf("%f %f\n", &x, &y);
+      fscanf(ctx->in, "%f %f\n", &x, &y);
 
       point *p = current_point(ctx);
       p->x = x;
@@ -317,7 +1232,7 @@ int exec_next_command(context *ctx) {
     }
     case move_to_d: {
       float dx, dy;
-      scanf("%f %f\n", &dx, &dy);
+      fscanf(ctx->in, "%f %f\n", &dx, &dy);
 
       point *p = current_point(ctx);
       p->x += dx;
@@ -327,7 +1242,7 @@ int exec_next_command(context *ctx) {
     }
     case line_to: {
       float x, y;
-      scanf("%f %f\n", &x, &y);
+      fscanf(ctx->in, "%f %f\n", &x, &y);
 
       add_to_path(ctx, x, y);
       set_tangent(ctx, 0, 0);
@@ -335,7 +1250,7 @@ int exec_next_command(context *ctx) {
     }
     case line_to_d: {
       float dx, dy;
-      scanf("%f %f\n", &dx, &dy);
+      fscanf(ctx->in, "%f %f\n", &dx, &dy);
 
       point p = *current_point(ctx);
       add_to_path(ctx, p.x + dx, p.y + dy);
@@ -344,7 +1259,7 @@ int exec_next_command(context *ctx) {
     }
     case v_line_to: {
       float y;
-      scanf("%f\n", &y);
+      fscanf(ctx->in, "%f\n", &y);
 
       point p = *current_point(ctx);
       add_to_path(ctx, p.x, y);
@@ -353,7 +1268,7 @@ int exec_next_command(context *ctx) {
     }
     case v_line_to_d: {
       float dy;
-      scanf("%f\n", &dy);
+      fscanf(ctx->in, "%f\n", &dy);
 
       point p = *current_point(ctx);
       add_to_path(ctx, p.x, p.y + dy);
@@ -362,7 +1277,7 @@ int exec_next_command(context *ctx) {
     }
     case h_line_to: {
       float x;
-      scanf("%f\n", &x);
+      fscanf(ctx->in, "%f\n", &x);
 
       point p = *current_point(ctx);
       add_to_path(ctx, x, p.y);
@@ -371,7 +1286,7 @@ int exec_next_command(context *ctx) {
     }
     case h_line_to_d: {
       float dx;
-      scanf("%f\n", &dx);
+      fscanf(ctx->in, "%f\n", &dx);
 
       point p = *current_point(ctx);
       add_to_path(ctx, p.x + dx, p.y);
@@ -380,41 +1295,39 @@ int exec_next_command(context *ctx) {
     }
     case curve_to: {
       float x1, y1, x2, y2, x3, y3;
-      scanf("%f %f %f %f %f %f\n", &x1, &y1, &x2, &y2, &x3, &y3);
+      fscanf(ctx->in, "%f %f %f %f %f %f\n", &x1, &y1, &x2, &y2, &x3, &y3);
 
-      point p = *current_point(ctx);
-      approx_bezier(ctx, p.x, p.y, x1, y1, x2, y2, x3, y3);
+      add_curve(ctx, x1, y1, x2, y2, x3, y3);
       set_tangent(ctx, x3 - x2, y3 - y2);
       break;
     }
     case curve_to_d: {
       float dx1, dy1, dx2, dy2, dx3, dy3;
-      scanf("%f %f %f %f %f %f\n", &dx1, &dy1, &dx2, &dy2, &dx3, &dy3);
+      fscanf(ctx->in, "%f %f %f %f %f %f\n", &dx1, &dy1, &dx2, &dy2, &dx3,
+             &dy3);
 
       point p = *current_point(ctx);
-      approx_bezier(ctx, p.x, p.y, p.x + dx1, p.y + dy1, p.x + dx2, p.y + dy2,
-                    p.x + dx3, p.y + dy3);
+      add_curve(ctx, p.x + dx1, p.y + dy1, p.x + dx2, p.y + dy2, p.x + dx3,
+                p.y + dy3);
       set_tangent(ctx, dx3 - dx2, dy3 - dy2);
       break;
     }
     case s_curve_to: {
       float x2, y2, x3, y3;
-      scanf("%f %f %f %f\n", &x2, &y2, &x3, &y3);
+      fscanf(ctx->in, "%f %f %f %f\n", &x2, &y2, &x3, &y3);
 
-      point p = *current_point(ctx);
       point cp = ctx->control;
-      approx_bezier(ctx, p.x, p.y, cp.x, cp.y, x2, y2, x3, y3);
+      add_curve(ctx, cp.x, cp.y, x2, y2, x3, y3);
       set_tangent(ctx, x3 - x2, y3 - y2);
       break;
     }
     case s_curve_to_d: {
       float dx2, dy2, dx3, dy3;
-      scanf("%f %f %f %f\n", &dx2, &dy2, &dx3, &dy3);
+      fscanf(ctx->in, "%f %f %f %f\n", &dx2, &dy2, &dx3, &dy3);
 
       point p = *current_point(ctx);
       point cp = ctx->control;
-      approx_bezier(ctx, p.x, p.y, cp.x, cp.y, p.x + dx2, p.y + dy2, p.x + dx3,
-                    p.y + dy3);
+      add_curve(ctx, cp.x, cp.y, p.x + dx2, p.y + dy2, p.x + dx3, p.y + dy3);
       set_tangent(ctx, dx3 - dx2, dy3 - dy2);
       break;
     }
@@ -423,23 +1336,183 @@ int exec_next_command(context *ctx) {
       add_to_path(ctx, p.x, p.y);
       break;
     }
+    case canvas: {
+      int w, h;
+      fscanf(ctx->in, "%d %d\n", &w, &h);
+      if (ctx->queue) {
+        pthread_mutex_lock(&ctx->queue->lock);
+        write_painted(ctx->queue, 0);
+        pthread_mutex_unlock(&ctx->queue->lock);
+      }
+      fprintf(ctx->out, "size %d %d\n", w, h);
+      ctx->canvas = 1;
+      break;
+    }
+    case rect: {
+      float x, y, w, h;
+      fscanf(ctx->in, "%f %f %f %f\n", &x, &y, &w, &h);
+
+      reset_path(ctx);
+      *current_point(ctx) = (point){x, y};
+      add_to_path(ctx, x + w, y);
+      add_to_path(ctx, x + w, y + h);
+      add_to_path(ctx, x, y + h);
+      add_to_path(ctx, x, y);
+      break;
+    }
+    case circle: {
+      float cx, cy, r;
+      fscanf(ctx->in, "%f %f %f\n", &cx, &cy, &r);
+      add_ellipse(ctx, cx, cy, r, r);
+      break;
+    }
+    case ellipse: {
+      float cx, cy, rx, ry;
+      fscanf(ctx->in, "%f %f %f %f\n", &cx, &cy, &rx, &ry);
+      add_ellipse(ctx, cx, cy, rx, ry);
+      break;
+    }
     case fill_and_stroke:
-      apply_transform(ctx);
-      fill_path(ctx);
-      stroke_path(ctx);
+      paint(ctx);
+      break;
+    case define: {
+      int id;
+      size_t n;
+      fscanf(ctx->in, "%d %zu\n", &id, &n);
+      define_symbol(ctx, id, n);
+      break;
+    }
+    case use: {
+      int id;
+      fscanf(ctx->in, "%d\n", &id);
+      draw_symbol(ctx, id);
+      break;
+    }
+    case begin_clip:
+    case end_clip:
+    case pop_clip:
+      clip_command(ctx, type);
+      break;
+    case begin_layer: {
+      float alpha;
+      fscanf(ctx->in, "%f\n", &alpha);
+      layer_command(ctx, type, alpha);
+      break;
+    }
+    case end_layer:
+      layer_command(ctx, type, 0);
       break;
   }
 
   return 1;
 }
 
-int main(int argc, char *argv[]) {
-  context ctx = {0};
+void interpret_commands(FILE *in, FILE *out, int scale) {
+  symbol_table symbols = {0};
+  context ctx = {.in = in, .out = out, .symbols = &symbols};
+  ctx.tolerance = epsilon / (scale * scale);
   ctx.style = calloc(1, sizeof(style));
   ctx.style->fill_color = 0;
   ctx.style->stroke_color = -1;
   ctx.style->stroke_width = 1;
+  ctx.style->fill_opacity = 1;
+  ctx.style->stroke_opacity = 1;
 
+  paint_queue *q = NULL;
+  pthread_t *threads = NULL;
+  if (n_threads > 1) {
+    q = calloc(1, sizeof(paint_queue));
+    threads = calloc(n_threads, sizeof(pthread_t));
+    if (!q || !threads) exit(1);
+    q->tolerance = ctx.tolerance;
+    q->out = out;
+    pthread_mutex_init(&q->lock, NULL);
+    pthread_cond_init(&q->ready, NULL);
+    pthread_cond_init(&q->finished, NULL);
+    for (int i = 0; i < n_threads; ++i) {
+      start_worker(&threads[i], paint_worker, q);
+    }
+    ctx.queue = q;
+  }
+
+  enter_phase(phase_interpret);
   while (exec_next_command(&ctx));
+  leave_phase();
+  while (ctx.layer) close_layer(&ctx.layer, &ctx.out);
+
+  if (q) {
+    pthread_mutex_lock(&q->lock);
+    q->closing = 1;
+    pthread_cond_broadcast(&q->ready);
+    write_painted(q, 0);
+    pthread_mutex_unlock(&q->lock);
+    while (q->layer) close_layer(&q->layer, &q->out);
+    for (int i = 0; i < n_threads; ++i) join_worker(threads[i]);
+    pthread_cond_destroy(&q->finished);
+    pthread_cond_destroy(&q->ready);
+    pthread_mutex_destroy(&q->lock);
+    free(threads);
+    free(q);
+  }
+
+  clear(&ctx.path);
+  while (ctx.transforms) pop_transform(&ctx);
+  free_styles(&ctx);
+  free_symbols(&symbols);
+}
+
+#ifndef NO_MAIN
+// For --curves: flattens n pseudo-random cubics, sixteen to a path, with
+// whichever flattener is selected and nothing else, so --stats times the
+// flatteners on equal input. Curves span 1 to 64 units, as in the corpus.
+static void flatten_curves(int n, int scale) {
+  context ctx = {.tolerance = epsilon / (scale * scale)};
+  unsigned seed = 1;
+  float c[6];
+  for (int i = 0; i < n; i += 16) {
+    reset_path(&ctx);
+    for (int j = 0; j < 16 && i + j < n; ++j) {
+      seed = seed * 1103515245 + 12345;
+      float size = 1 << (seed >> 16) % 7;
+      for (int k = 0; k < 6; ++k) {
+        seed = seed * 1103515245 + 12345;
+        c[k] = size * ((seed >> 8 & 0xffff) / 65536.0f - 0.5f);
+      }
+      point *p = current_point(&ctx);
+      add_curve(&ctx, p->x + c[0], p->y + c[1], p->x + c[2], p->y + c[3],
+                p->x + c[4], p->y + c[5]);
+    }
+    enter_phase(phase_flatten);
+    flatten_path(&ctx);
+    leave_phase();
+    clear(&ctx.path);
+  }
+}
+
+int main(int argc, char *argv[]) {
+  argc = stats_option(argc, argv);
+
+  int scale = 1, n_numbers = 0, curves = 0;
+  for (int i = 1; i < argc; ++i) {
+    if (strcmp(argv[i], "-j") == 0 && i + 1 < argc) {
+      sscanf(argv[++i], "%d", &n_threads);
+    } else if (strcmp(argv[i], "--batch") == 0) {
+      batched = 1;
+    } else if (strcmp(argv[i], "--simplify") == 0 && i + 1 < argc) {
+      sscanf(argv[++i], "%f", &simplify);
+    } else if (strcmp(argv[i], "--curves") == 0 && i + 1 < argc) {
+      sscanf(argv[++i], "%d", &curves);
+    } else if (n_numbers++ == 0) {
+      sscanf(argv[i], "%d", &scale);
+    }
+  }
+
+  if (curves > 0) {
+    flatten_curves(curves, scale);
+  } else {
+    interpret_commands(stdin, stdout, scale);
+  }
+  if (run_stats.enabled) print_stats(stderr, "interpret", NULL);
   return 0;
-}
\ No newline at end of file
+}
+#endif
\ No newline at end of file
@@ -1,40 +1,60 @@
 #include <math.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
-float min(float a, float b) { return a < b ? a : b; }
-float max(float a, float b) { return a < b ? b : a; }
+#include "stats.h"
+#include "svg.h"
 
-float overlap(float start1, float end1, float start2, float end2) {
+static float min(float a, float b) { return a < b ? a : b; }
+static float max(float a, float b) { return a < b ? b : a; }
+
+static float overlap(float start1, float end1, float start2, float end2) {
   return max(0.0f, min(end1, end2) - max(start1, start2));
 }
 
+typedef float v4 __attribute__((vector_size(16)));
+typedef int v4i __attribute__((vector_size(16)));
+
+static v4 load4(const float *p) {
+  v4 v;
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
+
 typedef struct point {
   float x, y;
   struct point *next;
 } point;
 
-void free_list(point *l) {
-  if (l) {
-    free_list(l->next);
-    free(l);
-  }
-}
+static _Thread_local point *free_points;
 
 typedef struct point_list {
   point *head;
   point *tail;
 } point_list;
 
-void clear(point_list *l) {
-  free_list(l->head);
+static void clear(point_list *l) {
+  if (l->head) {
+    l->tail->next = free_points;
+    free_points = l->head;
+  }
   l->head = l->tail = NULL;
 }
 
-void add_point(point_list *l, float x, float y) {
-  point *p = calloc(1, sizeof(point));
+static void add_point(point_list *l, float x, float y) {
+  point *p = free_points;
+  if (p)
+    free_points = p->next;
+  else
+    p = malloc(sizeof(point));
   p->x = x;
   p->y = y;
+  p->next = NULL;
 
   if (!l->head)
     l->head = l->tail = p;
@@ -45,6 +65,8 @@ void add_point(point_list *l, float x, float y) {
 typedef struct edge {
   float y_start, y_end, x, k;
   int winding;
+  int fx, fq;
+  int64_t fr, frem, fdy;
   struct edge *next;
 } edge;
 
@@ -53,15 +75,46 @@ typedef struct edge_list {
   edge *tail;
 } edge_list;
 
-void append(edge_list *l, edge *e) {
+static _Thread_local edge *free_edges;
+
+static void *reserve(void *buffer, size_t *capacity, size_t n) {
+  if (n > *capacity) {
+    free(buffer);
+    buffer = malloc(n);
+    if (!buffer) exit(1);
+    *capacity = n;
+  }
+  return memset(buffer, 0, n);
+}
+
+static edge *new_edge(void) {
+  edge *e = free_edges;
+  if (!e) return calloc(1, sizeof(edge));
+  free_edges = e->next;
+  memset(e, 0, sizeof(edge));
+  return e;
+}
+
+static void free_edge(edge *e) {
+  e->next = free_edges;
+  free_edges = e;
+}
+
+static void append(edge_list *l, edge *e) {
   if (!l->head)
     l->head = l->tail = e;
   else
     l->tail = l->tail->next = e;
 }
 
-void add(edge_list *l, point *a, point *b) {
-  edge *e = calloc(1, sizeof(edge));
+static edge_list *edge_table(int n) {
+  static _Thread_local edge_list *table;
+  static _Thread_local size_t capacity;
+  return table = reserve(table, &capacity, n * sizeof(edge_list));
+}
+
+static void add(edge_list *table, int first, point *a, point *b) {
+  edge *e = new_edge();
   if (a->y > b->y) {
     e->winding = 1;
     point *tmp = a;
@@ -74,143 +127,538 @@ void add(edge_list *l, point *a, point *b) {
   e->y_end = b->y;
   e->x = a->x;
   e->k = (b->x - a->x) / (b->y - a->y);
-  append(l, e);
+  append(&table[(int)ceilf(e->y_start) - first], e);
+  count(count_edges, 1);
 }
 
-edge *pop_head(edge_list *l) {
-  if (!l->head) return NULL;
+#define FIX 8
+#define ONE (1 << FIX)
+#define FIX_Y 16
+#define ONE_Y (1 << FIX_Y)
 
-  edge *popped = l->head;
+static int fixed(float v) { return lrintf(v * ONE); }
 
-  if (l->head == l->tail)
-    l->head = l->tail = NULL;
-  else
-    l->head = l->head->next;
+static int64_t fixed_y(float v) { return llrintf(v * ONE_Y); }
+
+static int ceil_fixed(int v) { return (v + ONE - 1) >> FIX; }
 
-  popped->next = NULL;
-  return popped;
+static void floor_div(int64_t n, int64_t d, int *q, int64_t *r) {
+  int64_t quot = n / d, rem = n % d;
+  if (rem < 0) {
+    --quot;
+    rem += d;
+  }
+  *q = quot;
+  *r = rem;
 }
 
-void quick_sort(edge_list *l, float (*key_func)(edge *)) {
-  if (!l->head) return;
+static void add_fixed(edge_list *table, int first_row, point *a, point *b) {
+  int winding = -1;
+  if (a->y > b->y) {
+    winding = 1;
+    point *tmp = a;
+    a = b;
+    b = tmp;
+  }
 
-  edge_list left = {0}, right = {0};
-  edge *pivot = l->head;
+  int x0 = fixed(a->x), x1 = fixed(b->x);
+  int64_t y0 = fixed_y(a->y), y1 = fixed_y(b->y);
+  int first = (y0 + ONE_Y - 1) >> FIX_Y, last = (y1 + ONE_Y - 1) >> FIX_Y;
+  if (first >= last) return;
 
-  edge *e = pivot->next;
-  pivot->next = NULL;
+  edge *e = new_edge();
+  e->winding = winding;
+  e->y_start = first;
+  e->y_end = last;
+  e->fdy = y1 - y0;
+  floor_div((int64_t)(x1 - x0) * ((int64_t)first * ONE_Y - y0), e->fdy, &e->fx,
+            &e->frem);
+  e->fx += x0;
+  floor_div((int64_t)(x1 - x0) * ONE_Y, e->fdy, &e->fq, &e->fr);
+  append(&table[first - first_row], e);
+  count(count_edges, 1);
+}
+
+static void step_fixed(edge *e) {
+  e->fx += e->fq;
+  e->frem += e->fr;
+  if (e->frem >= e->fdy) {
+    ++e->fx;
+    e->frem -= e->fdy;
+  }
+}
+
+static void insertion_sort(edge_list *l, float (*key_func)(edge *)) {
+  edge *e = l->head;
+  l->head = l->tail = NULL;
   while (e) {
     edge *next = e->next;
     e->next = NULL;
-    if (key_func(e) < key_func(pivot))
-      append(&left, e);
-    else
-      append(&right, e);
+    if (!l->head || key_func(e) >= key_func(l->tail)) {
+      append(l, e);
+    } else if (key_func(e) < key_func(l->head)) {
+      e->next = l->head;
+      l->head = e;
+    } else {
+      edge *p = l->head;
+      while (key_func(p->next) <= key_func(e)) p = p->next;
+      e->next = p->next;
+      p->next = e;
+    }
     e = next;
   }
-
-  quick_sort(&left, key_func);
-  quick_sort(&right, key_func);
-
-  if (left.head) {
-    l->head = left.head;
-    left.tail->next = pivot;
-  } else {
-    l->head = pivot;
-  }
-
-  if (right.tail) {
-    l->tail = right.tail;
-    pivot->next = right.head;
-  } else {
-    l->tail = pivot;
-  }
 }
 
-float by_x(edge *e) { return e->x; }
+static float by_x(edge *e) { return e->x; }
 
-float by_y_start(edge *e) { return e->y_start; }
+static float by_fixed_x(edge *e) { return e->fx; }
 
+enum {
+  record_end,
+  record_polygon,
+  record_push_clip,
+  record_pop_clip,
+  record_push_layer,
+  record_pop_layer
+};
+
+// kind is one of the records above; a pushed clip is made of the next n
+// polygons, and a pushed layer has its opacity in alpha and its bounding
+// box (x0, y0, x1, y1) in box.
 typedef struct polygon {
-  int color;
+  int kind;
+  int color, n;
+  float alpha, box[4];
   point_list vertices;
 } polygon;
 
-int size = 900;
-int scale = 1;
-int aa = 1;
-int debug = 0;
-
 #define C(image, w, x, y, c) (image)[((y) * (w) + (x)) * 4 + (c)]
 
-int read_polygon(polygon *p) {
-  int n;
-  if (scanf("%x %d\n", &p->color, &n) == EOF) return 0;
+// Polygons start with their color in hex, which no record word does. A
+// pushed layer's opacity and box go in v.
+static int read_record(FILE *in, int *color, int *n, float *v) {
+  int k = fscanf(in, "%x %d\n", color, n);
+  if (k == 2) return record_polygon;
+  char op[8], what[8];
+  if (k != 0 || fscanf(in, "%7s %7s\n", op, what) != 2) return record_end;
+  int push = strcmp(op, "push") == 0;
+  if (!push && strcmp(op, "pop") != 0) return record_end;
+  if (strcmp(what, "clip") == 0) {
+    if (!push) return record_pop_clip;
+    if (fscanf(in, "%d\n", n) == 1) return record_push_clip;
+  } else if (strcmp(what, "layer") == 0) {
+    if (!push) return record_pop_layer;
+    if (fscanf(in, "%f %f %f %f %f\n", &v[0], &v[1], &v[2], &v[3],
+               &v[4]) == 5)
+      return record_push_layer;
+  }
+  return record_end;
+}
 
+static int read_polygon(raster_options *o, FILE *in, polygon *p) {
+  int n;
+  float v[5];
+  enter_phase(phase_read);
+  p->kind = read_record(in, &p->color, &n, v);
+  if (p->kind == record_end) {
+    leave_phase();
+    return 0;
+  }
   clear(&p->vertices);
+  if (p->kind == record_push_layer) {
+    float sy = o->debug ? o->scale : o->scale * o->aa;
+    p->alpha = v[0];
+    p->box[0] = (v[1] - o->crop_x) * o->scale;
+    p->box[1] = (v[2] - o->crop_y) * sy;
+    p->box[2] = (v[3] - o->crop_x) * o->scale;
+    p->box[3] = (v[4] - o->crop_y) * sy;
+  }
+  if (p->kind != record_polygon) {
+    p->n = n;
+    leave_phase();
+    return 1;
+  }
+  count(count_polygons, 1);
+
   while (n--) {
     float x, y;
-    scanf("%f %f\n", &x, &y);
-    if (debug) {
-      add_point(&p->vertices, x * scale, y * scale);
+    fscanf(in, "%f %f\n", &x, &y);
+    x -= o->crop_x;
+    y -= o->crop_y;
+    if (o->debug) {
+      add_point(&p->vertices, x * o->scale, y * o->scale);
     } else {
-      add_point(&p->vertices, x * scale, y * scale * aa);
+      add_point(&p->vertices, x * o->scale, y * o->scale * o->aa);
     }
   }
+  leave_phase();
   return 1;
 }
 
-void put_pixel(float *I, int w, int h, int x, int y, float r1, float g1,
-               float b1, float a1) {
-  if (x < 0 || x >= w || y < 0 || y >= h) return;
+#define TILE 32
+
+enum { tile_untouched, tile_solid, tile_mixed };
+
+// Tiles start untouched (all zero). Rows that one polygon covers edge to
+// edge with full coverage are only recorded in `rows`; if that polygon
+// covers every row the tile becomes a solid color, otherwise it is
+// materialized into per-sample data.
+typedef struct tile {
+  int state;
+  int w, h;
+  float color[4];
+  float *data;
+  int pending;
+  uint32_t rows;
+  float pending_color[4];
+} tile;
+
+// A framebuffer covers w x h samples from (ox, oy) on the canvas; only a
+// layer's origin is not at zero. layer is the innermost open layer, which
+// drawing goes to instead of the canvas.
+typedef struct framebuffer {
+  int w, h;
+  int ox, oy;
+  int tw, th;
+  tile *tiles;
+  int polygon;
+  struct clip *clip;
+  struct layer *layer;
+} framebuffer;
+
+static _Thread_local void *free_tile_data;
+
+static float *tile_data(void) {
+  void *p = free_tile_data;
+  if (p) {
+    free_tile_data = *(void **)p;
+  } else {
+    p = malloc(TILE * TILE * 4 * sizeof(float));
+    if (!p) exit(1);
+  }
+  count(count_tiles, 1);
+  return p;
+}
+
+static void free_tiles(framebuffer *fb) {
+  for (int i = 0; i < fb->tw * fb->th; ++i) {
+    if (fb->tiles[i].state != tile_mixed) continue;
+    *(void **)fb->tiles[i].data = free_tile_data;
+    free_tile_data = fb->tiles[i].data;
+  }
+}
+
+static void init_tiles(framebuffer *fb, int w, int h, tile **tiles,
+                       size_t *capacity) {
+  fb->w = w;
+  fb->h = h;
+  fb->tw = (w + TILE - 1) / TILE;
+  fb->th = (h + TILE - 1) / TILE;
+  fb->tiles = *tiles =
+      reserve(*tiles, capacity, (size_t)fb->tw * fb->th * sizeof(tile));
+  fb->polygon = 0;
+  for (int ty = 0; ty < fb->th; ++ty) {
+    for (int tx = 0; tx < fb->tw; ++tx) {
+      tile *t = &fb->tiles[ty * fb->tw + tx];
+      t->w = w - tx * TILE < TILE ? w - tx * TILE : TILE;
+      t->h = h - ty * TILE < TILE ? h - ty * TILE : TILE;
+    }
+  }
+}
 
-  float b2 = C(I, w, x, y, 0);
-  float g2 = C(I, w, x, y, 1);
-  float r2 = C(I, w, x, y, 2);
-  float a2 = C(I, w, x, y, 3);
+static void init_framebuffer(framebuffer *fb, int w, int h) {
+  static _Thread_local tile *tiles;
+  static _Thread_local size_t capacity;
+  init_tiles(fb, w, h, &tiles, &capacity);
+}
+
+static tile *tile_at(framebuffer *fb, int x, int y) {
+  return &fb->tiles[(y / TILE) * fb->tw + x / TILE];
+}
+
+static float *tile_pixel(tile *t, int x, int y) {
+  return t->data + ((y % TILE) * TILE + x % TILE) * 4;
+}
+
+static void fill_pixels(float *p, int n, const float *color) {
+  for (int i = 0; i < n; ++i) memcpy(p + i * 4, color, 4 * sizeof(float));
+}
+
+static void materialize(tile *t) {
+  if (t->state == tile_mixed) return;
+  static const float zero[4];
+  t->data = tile_data();
+  fill_pixels(t->data, TILE * TILE, t->state == tile_solid ? t->color : zero);
+  for (int y = 0; t->pending && y < TILE; ++y) {
+    if (t->rows >> y & 1) {
+      fill_pixels(t->data + y * TILE * 4, TILE, t->pending_color);
+    }
+  }
+  t->pending = 0;
+  t->rows = 0;
+  t->state = tile_mixed;
+}
+
+static void settle(framebuffer *fb, tile *t) {
+  if (!t->pending || t->pending == fb->polygon) return;
+  uint32_t all = t->h == 32 ? 0xffffffff : (1u << t->h) - 1;
+  if (t->rows == all) {
+    memcpy(t->color, t->pending_color, sizeof(t->color));
+    t->state = tile_solid;
+    t->pending = 0;
+    t->rows = 0;
+  } else {
+    materialize(t);
+  }
+}
+
+static void put_pixel(framebuffer *fb, int x, int y, float r1, float g1,
+                      float b1, float a1) {
+  if (x < 0 || x >= fb->w || y < 0 || y >= fb->h) return;
+
+  tile *t = tile_at(fb, x, y);
+  settle(fb, t);
+  materialize(t);
+  float *I = tile_pixel(t, x, y);
+
+  float b2 = I[0];
+  float g2 = I[1];
+  float r2 = I[2];
+  float a2 = I[3];
 
   float a = a1 + a2 * (1 - a1);
   if (a == 0) return;
 
   float w1 = a1 / a, w2 = a2 * (1 - a1) / a;
-  C(I, w, x, y, 0) = b1 * w1 + b2 * w2;
-  C(I, w, x, y, 1) = g1 * w1 + g2 * w2;
-  C(I, w, x, y, 2) = r1 * w1 + r2 * w2;
-  C(I, w, x, y, 3) = a;
+  I[0] = b1 * w1 + b2 * w2;
+  I[1] = g1 * w1 + g2 * w2;
+  I[2] = r1 * w1 + r2 * w2;
+  I[3] = a;
 }
 
-void rasterize(float *image, polygon *p) {
-  int w = size * scale, h = size * scale * aa;
+// Pixels in [x0, x1) are fully covered by an opaque color, which put_pixel
+// would store unchanged.
+static void fill_run(framebuffer *fb, int y, int x0, int x1, float r, float g,
+                     float b) {
+  float color[4] = {b, g, r, 1};
+  while (x0 < x1) {
+    tile *t = tile_at(fb, x0, y);
+    int left = x0 / TILE * TILE, right = left + t->w;
+    int end = x1 < right ? x1 : right;
+    settle(fb, t);
+    if (x0 == left && end == right && t->state != tile_mixed) {
+      t->pending = fb->polygon;
+      memcpy(t->pending_color, color, sizeof(color));
+      t->rows |= 1u << y % TILE;
+    } else {
+      materialize(t);
+      fill_pixels(tile_pixel(t, x0, y), end - x0, color);
+    }
+    x0 = end;
+  }
+}
 
-  edge_list remaining = {0}, active = {0};
+static void settle_all(framebuffer *fb) {
+  ++fb->polygon;
+  for (int i = 0; i < fb->tw * fb->th; ++i) settle(fb, &fb->tiles[i]);
+}
 
+// gamma < 0 selects the sRGB transfer curve.
+static float decode_gamma(float gamma, float v) {
+  if (gamma > 0) return powf(v, gamma);
+  return v <= 0.04045f ? v / 12.92f : powf((v + 0.055f) / 1.055f, 2.4f);
+}
+
+static float encode_gamma(float gamma, float v) {
+  if (gamma > 0) return powf(v, 1 / gamma);
+  return v <= 0.0031308f ? v * 12.92f : 1.055f * powf(v, 1 / 2.4f) - 0.055f;
+}
+
+// With a gamma set, polygon colors are decoded to linear light so that
+// coverage blends linearly; resolve encodes them again. A color that is not
+// opaque has its alpha in the top byte.
+static void polygon_color(raster_options *o, polygon *p, float *r, float *g,
+                          float *b, float *alpha) {
   int mask = (1 << 8) - 1;
-  float r = (p->color >> 16 & mask) / 255.0f;
-  float g = (p->color >> 8 & mask) / 255.0f;
-  float b = (p->color & mask) / 255.0f;
+  float c[3];
+  for (int i = 0; i < 3; ++i) {
+    c[i] = (p->color >> (16 - 8 * i) & mask) / 255.0f;
+    if (o->gamma) c[i] = decode_gamma(o->gamma, c[i]);
+  }
+  *r = c[0];
+  *g = c[1];
+  *b = c[2];
+  unsigned a = (unsigned)p->color >> 24;
+  *alpha = a ? a / 255.0f : 1;
+}
 
-  add(&remaining, p->vertices.tail, p->vertices.head);
-  for (point *v = p->vertices.head; v != p->vertices.tail; v = v->next) {
-    add(&remaining, v, v->next);
+typedef struct rect {
+  float x0, y0, x1, y1;
+  int fx0, fx1;
+} rect;
+
+// Matches four corners, optionally followed by a repeat of the first, joined
+// by alternating horizontal and vertical sides.
+static int axis_aligned(polygon *p, rect *q) {
+  point *v[5];
+  int n = 0;
+  for (point *u = p->vertices.head; u; u = u->next) {
+    if (n == 5) return 0;
+    v[n++] = u;
+  }
+  if (n == 5 && (v[4]->x != v[0]->x || v[4]->y != v[0]->y)) return 0;
+  if (n < 4) return 0;
+
+  int h = v[0]->y == v[1]->y && v[1]->x == v[2]->x && v[2]->y == v[3]->y &&
+          v[3]->x == v[0]->x;
+  int w = v[0]->x == v[1]->x && v[1]->y == v[2]->y && v[2]->x == v[3]->x &&
+          v[3]->y == v[0]->y;
+  if (!h && !w) return 0;
+
+  q->x0 = min(v[0]->x, v[2]->x);
+  q->x1 = max(v[0]->x, v[2]->x);
+  q->y0 = min(v[0]->y, v[2]->y);
+  q->y1 = max(v[0]->y, v[2]->y);
+  q->fx0 = fixed(q->x0);
+  q->fx1 = fixed(q->x1);
+  return 1;
+}
+
+static float cover(rect *q, int x) {
+  return overlap(x - 0.5, x + 0.5, q->x0, q->x1);
+}
+
+static float cover_fixed(rect *q, int x) {
+  int lo = x * ONE - ONE / 2, hi = lo + ONE;
+  int a = (hi < q->fx1 ? hi : q->fx1) - (lo > q->fx0 ? lo : q->fx0);
+  return a * (1.0f / ONE);
+}
+
+// Every row of an axis-aligned rectangle has the same span, so there are no
+// edges to set up: the partially covered columns at either end are found
+// once and the rest of each row is a full-coverage run. Rows and columns
+// are canvas coordinates.
+static void fill_rect(framebuffer *fb, rect *q, int top, int bottom,
+                      int start, int end, float (*cover)(rect *, int),
+                      float r, float g, float b, float alpha) {
+  int ox = fb->ox, oy = fb->oy;
+  if (top < oy) top = oy;
+  if (bottom > oy + fb->h) bottom = oy + fb->h;
+  if (start < ox) start = ox;
+  if (end > ox + fb->w) end = ox + fb->w;
+
+  int inner = end, outer = end;
+  if (alpha == 1) {
+    inner = start;
+    while (inner < end && cover(q, inner) < 1) ++inner;
+    while (outer > inner && cover(q, outer - 1) < 1) --outer;
+  }
+
+  enter_phase(phase_scan_convert);
+  for (int y = top; y < bottom; ++y) {
+    count(count_spans, 1);
+    if (end > start) count(count_pixels, end - start);
+    for (int x = start; x < inner; ++x) {
+      float a = cover(q, x);
+      if (a > 0) put_pixel(fb, x - ox, y - oy, r, g, b, a * alpha);
+    }
+    if (inner < outer) fill_run(fb, y - oy, inner - ox, outer - ox, r, g, b);
+    for (int x = outer; x < end; ++x) {
+      float a = cover(q, x);
+      if (a > 0) put_pixel(fb, x - ox, y - oy, r, g, b, a * alpha);
+    }
+  }
+  leave_phase();
+}
+
+// Draws the span [x0, x1] of canvas row y; fully covered pixels of an
+// opaque color go through fill_run.
+static void draw_span(framebuffer *fb, int y, float x0, float x1, float r,
+                      float g, float b, float alpha) {
+  y -= fb->oy;
+  x0 -= fb->ox;
+  x1 -= fb->ox;
+  int start = ceilf(x0 - 0.5);
+  int end = ceilf(x1 + 0.5);
+  if (start < 0) start = 0;
+  if (end > fb->w) end = fb->w;
+  count(count_spans, 1);
+  if (end > start) count(count_pixels, end - start);
+  if (alpha < 1) {
+    for (int x = start; x < end; ++x) {
+      float a = overlap(x - 0.5, x + 0.5, x0, x1);
+      if (a > 0) put_pixel(fb, x, y, r, g, b, a * alpha);
+    }
+    return;
   }
+  int run = start;
+  for (int x = start; x < end; ++x) {
+    float a = overlap(x - 0.5, x + 0.5, x0, x1);
+    if (a == 1) continue;
+    if (run < x) fill_run(fb, y, run, x, r, g, b);
+    run = x + 1;
+    if (a > 0) put_pixel(fb, x, y, r, g, b, a);
+  }
+  if (run < end) fill_run(fb, y, run, end, r, g, b);
+}
+
+static void draw_span_fixed(framebuffer *fb, int y, int x0, int x1, float r,
+                            float g, float b, float alpha) {
+  y -= fb->oy;
+  x0 -= fb->ox * ONE;
+  x1 -= fb->ox * ONE;
+  int start = ceil_fixed(x0 - ONE / 2);
+  int end = ceil_fixed(x1 + ONE / 2);
+  if (start < 0) start = 0;
+  if (end > fb->w) end = fb->w;
+  count(count_spans, 1);
+  if (end > start) count(count_pixels, end - start);
+  int run = start;
+  for (int x = start; x < end; ++x) {
+    int lo = x * ONE - ONE / 2, hi = lo + ONE;
+    int a = (hi < x1 ? hi : x1) - (lo > x0 ? lo : x0);
+    if (a == ONE && alpha == 1) continue;
+    if (run < x) fill_run(fb, y, run, x, r, g, b);
+    run = x + 1;
+    if (a > 0) put_pixel(fb, x, y, r, g, b, a * (alpha / ONE));
+  }
+  if (run < end) fill_run(fb, y, run, end, r, g, b);
+}
 
-  if (!remaining.head) return;
+typedef void span_func(void *arg, int y, float x0, float x1);
 
-  quick_sort(&remaining, by_y_start);
+// Steps the polygon's edges down its rows and passes each span between
+// edges of nonzero winding on rows [top, bottom) to f.
+static void scan_polygon(polygon *p, int top, int bottom, span_func *f,
+                         void *arg) {
+  edge_list active = {0};
 
-  int y = ceilf(remaining.head->y_start) - 1;
-  while (active.head || remaining.head) {
+  enter_phase(phase_edge_build);
+  float y_min = p->vertices.head->y, y_max = y_min;
+  for (point *v = p->vertices.head; v; v = v->next) {
+    y_min = min(y_min, v->y);
+    y_max = max(y_max, v->y);
+  }
+  int first = ceilf(y_min), last = ceilf(y_max) + 1;
+  if (first >= bottom || last <= top) {
+    leave_phase();
+    return;
+  }
+  edge_list *table = edge_table(last - first);
+
+  add(table, first, p->vertices.tail, p->vertices.head);
+  for (point *v = p->vertices.head; v != p->vertices.tail; v = v->next) {
+    add(table, first, v, v->next);
+  }
+  leave_phase();
+
+  enter_phase(phase_scan_convert);
+  int y = first - 1;
+  while (active.head || y < last) {
     int cur_winding = 0;
     float prev_x = 0;
     for (edge *e = active.head; e; e = e->next) {
-      if (cur_winding) {
-        int start = ceilf(prev_x - 0.5);
-        int end = ceilf(e->x + 0.5);
-        for (int x = start; x < end; ++x) {
-          float a = overlap(x - 0.5, x + 0.5, prev_x, e->x);
-          put_pixel(image, w, h, x, y, r, g, b, a);
-        }
-      }
+      if (cur_winding && y >= top && y < bottom) f(arg, y, prev_x, e->x);
       cur_winding += e->winding;
       prev_x = e->x;
     }
@@ -223,30 +671,464 @@ void rasterize(float *image, polygon *p) {
       edge *next = e->next;
       e->next = NULL;
       if (e->y_end <= y) {
-        free(e);
+        free_edge(e);
       } else {
         e->x += e->k;
         append(&active, e);
       }
       e = next;
     }
-    while (remaining.head && remaining.head->y_start <= y) {
-      edge *e = pop_head(&remaining);
+    for (e = y < last ? table[y - first].head : NULL; e;) {
+      edge *next = e->next;
+      e->next = NULL;
       if (e->y_end <= y) {
-        free(e);
+        free_edge(e);
       } else {
         e->x += e->k * (y - e->y_start);
         append(&active, e);
       }
+      e = next;
+    }
+    insertion_sort(&active, by_x);
+  }
+  leave_phase();
+}
+
+// A clip region as sorted, disjoint spans per framebuffer row, already cut
+// down to the clip it was pushed inside. A clip that is one axis-aligned
+// rectangle keeps only its box (x0, x1, y0, y1) and has no span lists.
+// Under --fixed the spans and the box's x range are kept in fixed point too.
+typedef struct clip {
+  int top, bottom;
+  int *start;
+  float *spans;
+  int *fixed_spans;
+  float box[4];
+  int fixed_box[2];
+  struct clip *parent;
+} clip;
+
+typedef struct row_span {
+  int y;
+  float x0, x1;
+} row_span;
+
+// The clip being read: how many of its polygons are still to come, and the
+// spans of those already scan-converted.
+typedef struct clip_builder {
+  int left, total;
+  int is_rect, fixed;
+  rect box;
+  row_span *v;
+  int n, capacity;
+} clip_builder;
+
+static _Thread_local clip_builder building;
+
+static int clip_row(clip *c, int y, const float **spans) {
+  if (y < c->top || y >= c->bottom) return 0;
+  if (!c->start) {
+    *spans = c->box;
+    return 1;
+  }
+  int *k = &c->start[y - c->top];
+  *spans = c->spans + 2 * k[0];
+  return k[1] - k[0];
+}
+
+// Draws the parts of [x0, x1] on row y that lie inside the clip.
+static void clip_span(framebuffer *fb, int y, float x0, float x1, float r,
+                      float g, float b, float alpha) {
+  const float *s;
+  int n = clip_row(fb->clip, y, &s);
+  for (int i = 0; i < n && s[2 * i] < x1; ++i) {
+    float lo = max(x0, s[2 * i]), hi = min(x1, s[2 * i + 1]);
+    if (lo < hi) draw_span(fb, y, lo, hi, r, g, b, alpha);
+  }
+}
+
+static int clip_row_fixed(clip *c, int y, const int **spans) {
+  if (y < c->top || y >= c->bottom) return 0;
+  if (!c->start) {
+    *spans = c->fixed_box;
+    return 1;
+  }
+  int *k = &c->start[y - c->top];
+  *spans = c->fixed_spans + 2 * k[0];
+  return k[1] - k[0];
+}
+
+// As clip_span, for a span in fixed point.
+static void clip_span_fixed(framebuffer *fb, int y, int x0, int x1, float r,
+                            float g, float b, float alpha) {
+  const int *s;
+  int n = clip_row_fixed(fb->clip, y, &s);
+  for (int i = 0; i < n && s[2 * i] < x1; ++i) {
+    int lo = s[2 * i], hi = s[2 * i + 1];
+    if (lo < x0) lo = x0;
+    if (hi > x1) hi = x1;
+    if (lo < hi) draw_span_fixed(fb, y, lo, hi, r, g, b, alpha);
+  }
+}
+
+// Narrows an axis-aligned polygon to a rectangular clip; returns 0 if the
+// clip has any other shape.
+static int clip_rect(clip *c, rect *q) {
+  if (!c) return 1;
+  if (c->start) return 0;
+  q->x0 = max(q->x0, c->box[0]);
+  q->x1 = max(q->x0, min(q->x1, c->box[1]));
+  q->y0 = max(q->y0, c->box[2]);
+  q->y1 = max(q->y0, min(q->y1, c->box[3]));
+  q->fx0 = fixed(q->x0);
+  q->fx1 = fixed(q->x1);
+  return 1;
+}
+
+static void collect_span(void *arg, int y, float x0, float x1) {
+  clip_builder *b = arg;
+  if (b->n == b->capacity) {
+    b->capacity = b->capacity ? 2 * b->capacity : 1024;
+    b->v = realloc(b->v, b->capacity * sizeof(row_span));
+    if (!b->v) exit(1);
+  }
+  b->v[b->n++] = (row_span){y, x0, x1};
+}
+
+static int by_row(const void *a, const void *b) {
+  const row_span *p = a, *q = b;
+  if (p->y != q->y) return p->y - q->y;
+  return (p->x0 > q->x0) - (p->x0 < q->x0);
+}
+
+// Merges the collected spans row by row and intersects them with the
+// enclosing clip, if any.
+static void build_clip(clip_builder *b, clip *c) {
+  static const float everything[2] = {-INFINITY, INFINITY};
+  qsort(b->v, b->n, sizeof(row_span), by_row);
+  int m = 0;
+  for (int i = 0; i < b->n; ++i) {
+    row_span *s = &b->v[i];
+    if (m && b->v[m - 1].y == s->y && s->x0 <= b->v[m - 1].x1)
+      b->v[m - 1].x1 = max(b->v[m - 1].x1, s->x1);
+    else
+      b->v[m++] = *s;
+  }
+
+  clip *parent = c->parent;
+  c->top = m ? b->v[0].y : 0;
+  c->bottom = m ? b->v[m - 1].y + 1 : 0;
+  int bound = m;
+  if (parent) {
+    if (c->top < parent->top) c->top = parent->top;
+    if (c->bottom > parent->bottom) c->bottom = parent->bottom;
+    bound += parent->start ? parent->start[parent->bottom - parent->top]
+                           : parent->bottom - parent->top;
+  }
+  if (c->bottom < c->top) c->bottom = c->top;
+  c->start = malloc((c->bottom - c->top + 1) * sizeof(int));
+  c->spans = malloc((2 * bound + 2) * sizeof(float));
+  if (!c->start || !c->spans) exit(1);
+
+  int k = 0, i = 0;
+  for (int y = c->top; y < c->bottom; ++y) {
+    c->start[y - c->top] = k;
+    while (i < m && b->v[i].y < y) ++i;
+    const float *p = everything;
+    int n = parent ? clip_row(parent, y, &p) : 1;
+    for (int j = 0; i < m && b->v[i].y == y && j < n;) {
+      float lo = max(b->v[i].x0, p[2 * j]), hi = min(b->v[i].x1, p[2 * j + 1]);
+      if (lo < hi) {
+        c->spans[2 * k] = lo;
+        c->spans[2 * k + 1] = hi;
+        ++k;
+      }
+      if (b->v[i].x1 < p[2 * j + 1])
+        ++i;
+      else
+        ++j;
     }
-    quick_sort(&active, by_x);
+  }
+  c->start[c->bottom - c->top] = k;
+
+  if (b->fixed) {
+    c->fixed_spans = malloc((2 * k + 2) * sizeof(int));
+    if (!c->fixed_spans) exit(1);
+    for (int i = 0; i < 2 * k; ++i) c->fixed_spans[i] = fixed(c->spans[i]);
   }
 }
 
-void plot_vertices(unsigned char *image, polygon *p) {
-  int w = size * scale, h = size * scale;
+static void push_clip(framebuffer *fb) {
+  clip_builder *b = &building;
+  clip *c = calloc(1, sizeof(clip));
+  if (!c) exit(1);
+  c->parent = fb->clip;
+  fb->clip = c;
+  count(count_clips, 1);
+
+  rect *q = &b->box;
+  if (b->is_rect && clip_rect(c->parent, q)) {
+    c->box[0] = q->x0;
+    c->box[1] = q->x1;
+    c->box[2] = q->y0;
+    c->box[3] = q->y1;
+    c->fixed_box[0] = q->fx0;
+    c->fixed_box[1] = q->fx1;
+    c->top = ceilf(q->y0);
+    c->bottom = ceilf(q->y1);
+    return;
+  }
+  if (b->is_rect) {
+    int top = max(ceilf(q->y0), fb->oy);
+    int bottom = min(ceilf(q->y1), fb->oy + fb->h);
+    for (int y = top; y < bottom; ++y) collect_span(b, y, q->x0, q->x1);
+  }
+  build_clip(b, c);
+}
+
+static void begin_clip(framebuffer *fb, int n, int fixed) {
+  if (building.left) exit(1);
+  building.left = building.total = n;
+  building.is_rect = 0;
+  building.fixed = fixed;
+  building.n = 0;
+  if (!n) push_clip(fb);
+}
+
+static void add_clip_polygon(framebuffer *fb, polygon *p) {
+  clip_builder *b = &building;
+  if (b->total == 1 && axis_aligned(p, &b->box))
+    b->is_rect = 1;
+  else if (p->vertices.head)
+    scan_polygon(p, fb->oy, fb->oy + fb->h, collect_span, b);
+  if (--b->left == 0) push_clip(fb);
+}
+
+static void pop_clip(framebuffer *fb) {
+  clip *c = fb->clip;
+  if (!c) exit(1);
+  fb->clip = c->parent;
+  free(c->start);
+  free(c->spans);
+  free(c->fixed_spans);
+  free(c);
+}
+
+// A layer holds a group's bounding box in tiles of its own, and is blended
+// onto the framebuffer below it when the group closes. Layers are pooled by
+// depth, so their tile arrays are reused from group to group, and their
+// tile data comes from the same free list as the canvas's.
+typedef struct layer {
+  framebuffer fb;
+  float alpha;
+  int depth;
+  tile *tiles;
+  size_t capacity;
+  struct layer *parent;
+} layer;
+
+static framebuffer *target(framebuffer *fb) {
+  return fb->layer ? &fb->layer->fb : fb;
+}
+
+static void push_layer(framebuffer *fb, polygon *p) {
+  static _Thread_local layer **pool;
+  static _Thread_local int pool_size;
+
+  framebuffer *below = target(fb);
+  int depth = fb->layer ? fb->layer->depth + 1 : 0;
+  if (depth == pool_size) {
+    pool = realloc(pool, ++pool_size * sizeof(layer *));
+    if (!pool || !(pool[depth] = calloc(1, sizeof(layer)))) exit(1);
+  }
+  layer *l = pool[depth];
+  count(count_layers, 1);
+
+  int x0 = max(floorf(p->box[0]), below->ox);
+  int y0 = max(floorf(p->box[1]), below->oy);
+  int x1 = min(ceilf(p->box[2]) + 1, below->ox + below->w);
+  int y1 = min(ceilf(p->box[3]) + 1, below->oy + below->h);
+  if (below->clip) {
+    y0 = max(y0, below->clip->top);
+    y1 = min(y1, below->clip->bottom);
+  }
+  init_tiles(&l->fb, max(x1 - x0, 0), max(y1 - y0, 0), &l->tiles,
+             &l->capacity);
+  l->fb.ox = x0;
+  l->fb.oy = y0;
+  l->fb.clip = below->clip;
+  l->alpha = p->alpha;
+  l->depth = depth;
+  l->parent = fb->layer;
+  fb->layer = l;
+}
+
+// Blends n pixels over dst at the layer's opacity, the same way put_pixel
+// blends one; src steps by `step` floats per pixel.
+static void blend_pixels(float *dst, const float *src, int step, int n,
+                         float alpha) {
+  for (int i = 0; i < n; ++i, src += step, dst += 4) {
+    v4 s = load4(src), d = load4(dst);
+    float a1 = s[3] * alpha;
+    if (a1 == 0) continue;
+    float a = a1 + d[3] * (1 - a1);
+    v4 p = s * (a1 / a) + d * (d[3] * (1 - a1) / a);
+    p[3] = a;
+    memcpy(dst, &p, sizeof(p));
+  }
+}
+
+// Tile rows of the layer are blended straight into the tiles below them;
+// untouched tiles are skipped, and solid ones blend their one color.
+static void composite(framebuffer *l, framebuffer *fb, float alpha) {
+  settle_all(l);
+  ++fb->polygon;
+  int dx = l->ox - fb->ox, dy = l->oy - fb->oy;
+  for (int i = 0; i < l->tw * l->th; ++i) {
+    tile *t = &l->tiles[i];
+    if (t->state == tile_untouched) continue;
+    int tx = i % l->tw * TILE, ty = i / l->tw * TILE;
+    int step = t->state == tile_mixed ? 4 : 0;
+    for (int y = 0; y < t->h; ++y) {
+      const float *src = step ? t->data + y * TILE * 4 : t->color;
+      int Y = ty + y + dy;
+      for (int x = 0; x < t->w;) {
+        int X = tx + x + dx, n = min(t->w - x, TILE - X % TILE);
+        tile *d = tile_at(fb, X, Y);
+        settle(fb, d);
+        materialize(d);
+        blend_pixels(tile_pixel(d, X, Y), src + x * step, step, n, alpha);
+        x += n;
+      }
+    }
+  }
+}
+
+static void pop_layer(framebuffer *fb) {
+  layer *l = fb->layer;
+  if (!l) exit(1);
+  framebuffer *below = l->parent ? &l->parent->fb : fb;
+  while (l->fb.clip != below->clip) pop_clip(&l->fb);
+  composite(&l->fb, below, l->alpha);
+  free_tiles(&l->fb);
+  fb->layer = l->parent;
+}
+
+typedef struct span_paint {
+  framebuffer *fb;
+  float r, g, b, a;
+} span_paint;
+
+static void paint_span(void *arg, int y, float x0, float x1) {
+  span_paint *s = arg;
+  if (s->fb->clip)
+    clip_span(s->fb, y, x0, x1, s->r, s->g, s->b, s->a);
+  else
+    draw_span(s->fb, y, x0, x1, s->r, s->g, s->b, s->a);
+}
+
+static void rasterize(raster_options *o, framebuffer *fb, polygon *p) {
+  ++fb->polygon;
+
+  span_paint s = {.fb = fb};
+  polygon_color(o, p, &s.r, &s.g, &s.b, &s.a);
+
+  rect q;
+  if (axis_aligned(p, &q) && clip_rect(fb->clip, &q)) {
+    fill_rect(fb, &q, ceilf(q.y0), ceilf(q.y1), ceilf(q.x0 - 0.5),
+              ceilf(q.x1 + 0.5), cover, s.r, s.g, s.b, s.a);
+    return;
+  }
+
+  int top = fb->oy, bottom = fb->oy + fb->h;
+  if (fb->clip) {
+    if (top < fb->clip->top) top = fb->clip->top;
+    if (bottom > fb->clip->bottom) bottom = fb->clip->bottom;
+  }
+  scan_polygon(p, top, bottom, paint_span, &s);
+}
+
+static void rasterize_fixed(raster_options *o, framebuffer *fb, polygon *p) {
+  int top = fb->oy, bottom = fb->oy + fb->h;
+  ++fb->polygon;
+
+  edge_list active = {0};
+
+  float r, g, b, alpha;
+  polygon_color(o, p, &r, &g, &b, &alpha);
+
+  rect q;
+  if (axis_aligned(p, &q) && clip_rect(fb->clip, &q)) {
+    fill_rect(fb, &q, (fixed_y(q.y0) + ONE_Y - 1) >> FIX_Y,
+              (fixed_y(q.y1) + ONE_Y - 1) >> FIX_Y, ceil_fixed(q.fx0 - ONE / 2),
+              ceil_fixed(q.fx1 + ONE / 2), cover_fixed, r, g, b, alpha);
+    return;
+  }
+
+  enter_phase(phase_edge_build);
+  float y_min = p->vertices.head->y, y_max = y_min;
+  for (point *v = p->vertices.head; v; v = v->next) {
+    y_min = min(y_min, v->y);
+    y_max = max(y_max, v->y);
+  }
+  int first = (fixed_y(y_min) + ONE_Y - 1) >> FIX_Y;
+  int last = ((fixed_y(y_max) + ONE_Y - 1) >> FIX_Y) + 1;
+  edge_list *table = edge_table(last - first);
+
+  add_fixed(table, first, p->vertices.tail, p->vertices.head);
+  for (point *v = p->vertices.head; v != p->vertices.tail; v = v->next) {
+    add_fixed(table, first, v, v->next);
+  }
+  leave_phase();
+
+  enter_phase(phase_scan_convert);
+  int y = first - 1;
+  while (active.head || y < last) {
+    int cur_winding = 0;
+    int prev_x = 0;
+    for (edge *e = active.head; e; e = e->next) {
+      if (cur_winding && y >= top && y < bottom) {
+        if (fb->clip)
+          clip_span_fixed(fb, y, prev_x, e->fx, r, g, b, alpha);
+        else
+          draw_span_fixed(fb, y, prev_x, e->fx, r, g, b, alpha);
+      }
+      cur_winding += e->winding;
+      prev_x = e->fx;
+    }
+
+    ++y;
+
+    edge *e = active.head;
+    active.head = active.tail = NULL;
+    while (e) {
+      edge *next = e->next;
+      e->next = NULL;
+      if (e->y_end <= y) {
+        free_edge(e);
+      } else {
+        step_fixed(e);
+        append(&active, e);
+      }
+      e = next;
+    }
+    for (e = y < last ? table[y - first].head : NULL; e;) {
+      edge *next = e->next;
+      e->next = NULL;
+      append(&active, e);
+      e = next;
+    }
+    insertion_sort(&active, by_fixed_x);
+  }
+  leave_phase();
+}
+
+static void plot_vertices(raster_options *o, unsigned char *image,
+                          polygon *p) {
+  int w = o->width * o->scale, h = o->height * o->scale;
   for (point *v = p->vertices.head; v; v = v->next) {
     int x = v->x, y = v->y;
+    if (x < 0 || x >= w || y < 0 || y >= h) continue;
     C(image, w, x, y, 0) = p->color;
     C(image, w, x, y, 1) = p->color >> 8;
     C(image, w, x, y, 2) = p->color >> 16;
@@ -297,7 +1179,7 @@ typedef struct __attribute__((packed)) BITMAPV4HEADER {
   uint32_t gamme_blue;
 } BITMAPV4HEADER;
 
-void write_bmp(unsigned char *pixel_data, int w, int h, const char *filename) {
+static void write_bmp(unsigned char *pixel_data, int w, int h, FILE *out) {
   BITMAPFILEHEADER file_header = {0};
   file_header.type = 0x4d42;
   file_header.size =
@@ -312,42 +1194,779 @@ void write_bmp(unsigned char *pixel_data, int w, int h, const char *filename) {
   DIB_header.bit_count = 32;
   DIB_header.alpha_mask = 0xff000000;
 
-  fwrite(&file_header, sizeof(BITMAPFILEHEADER), 1, stdout);
-  fwrite(&DIB_header, sizeof(BITMAPV4HEADER), 1, stdout);
-  fwrite(pixel_data, 4, w * h, stdout);
+  fwrite(&file_header, sizeof(BITMAPFILEHEADER), 1, out);
+  fwrite(&DIB_header, sizeof(BITMAPV4HEADER), 1, out);
+  fwrite(pixel_data, 4, w * h, out);
 }
 
-int main(int argc, char *argv[]) {
-  if (argc >= 2) sscanf(argv[1], "%d", &scale);
-  if (argc >= 3) sscanf(argv[2], "%d", &aa);
-  if (argc >= 4) sscanf(argv[3], "%d", &debug);
+// Layers only matter to the pixels, so the debug view ignores them.
+static void draw_polygon(raster_options *o, unsigned char *image,
+                         framebuffer *fb, polygon *p) {
+  framebuffer *t = target(fb);
+  if (p->kind == record_push_clip)
+    begin_clip(t, p->n, o->fixed);
+  else if (p->kind == record_pop_clip)
+    pop_clip(t);
+  else if (p->kind == record_push_layer) {
+    if (!o->debug) push_layer(fb, p);
+  } else if (p->kind == record_pop_layer) {
+    if (!o->debug) pop_layer(fb);
+  } else if (building.left)
+    add_clip_polygon(t, p);
+  else if (o->debug)
+    plot_vertices(o, image, p);
+  else if (o->fixed)
+    rasterize_fixed(o, t, p);
+  else
+    rasterize(o, t, p);
+}
+
+#define RING_SLOTS 64
+
+// Single producer, single consumer: the reader thread only advances head,
+// the raster thread only advances tail. Slots keep their vertex lists, so
+// the reader recycles the same points through its own pool.
+typedef struct polygon_ring {
+  polygon slots[RING_SLOTS];
+  _Atomic long head, tail;
+  _Atomic int done;
+  raster_options *options;
+  FILE *in;
+} polygon_ring;
+
+static void *read_polygons(void *arg) {
+  polygon_ring *r = arg;
+  for (long head = 0;; ++head) {
+    if (head - atomic_load_explicit(&r->tail, memory_order_acquire) ==
+        RING_SLOTS) {
+      count(count_read_stalls, 1);
+      while (head - atomic_load_explicit(&r->tail, memory_order_acquire) ==
+             RING_SLOTS)
+        sched_yield();
+    }
+    if (!read_polygon(r->options, r->in, &r->slots[head % RING_SLOTS])) break;
+    atomic_store_explicit(&r->head, head + 1, memory_order_release);
+  }
+  atomic_store_explicit(&r->done, 1, memory_order_release);
+  return NULL;
+}
 
-  int w = size * scale, h = size * scale;
-  unsigned char *image = calloc(1, h * w * 4);
+static polygon *next_polygon(polygon_ring *r, long tail) {
+  long head = atomic_load_explicit(&r->head, memory_order_acquire);
+  if (head == tail) {
+    count(count_raster_stalls, 1);
+    for (;;) {
+      int done = atomic_load_explicit(&r->done, memory_order_acquire);
+      head = atomic_load_explicit(&r->head, memory_order_acquire);
+      if (head != tail) break;
+      if (done) return NULL;
+      sched_yield();
+    }
+  }
+  count(count_queue_depth, head - tail);
+  return &r->slots[tail % RING_SLOTS];
+}
 
-  polygon p = {0};
+static void draw_pipelined(raster_options *o, FILE *in, unsigned char *image,
+                           framebuffer *fb) {
+  polygon_ring *r = calloc(1, sizeof(polygon_ring));
+  if (!r) exit(1);
+  r->options = o;
+  r->in = in;
 
-  if (debug) {
-    while (read_polygon(&p)) plot_vertices(image, &p);
-    write_bmp(image, w, h, "debug.bmp");
+  pthread_t reader;
+  start_worker(&reader, read_polygons, r);
+  polygon *p;
+  for (long tail = 0; (p = next_polygon(r, tail)); ++tail) {
+    draw_polygon(o, image, fb, p);
+    atomic_store_explicit(&r->tail, tail + 1, memory_order_release);
+  }
+  join_worker(reader);
+
+  for (int i = 0; i < RING_SLOTS; ++i) clear(&r->slots[i].vertices);
+  free(r);
+}
+
+#define LUT_BITS 16
+
+typedef struct resolver {
+  framebuffer *fb;
+  unsigned char *image;
+  int aa;
+  int y0, y1;
+  const unsigned char *lut;
+} resolver;
+
+// Rounds to nearest and saturates to [0, 255]; color channels go through the
+// gamma LUT when there is one.
+static void store4(unsigned char *dst, v4 p, const unsigned char *lut) {
+  const v4 zero = {0, 0, 0, 0}, one = {1, 1, 1, 1};
+  v4i low = p < zero, high = p > one;
+  p = (v4)(((v4i)p & ~(low | high)) | ((v4i)one & high));
+  v4i q = __builtin_convertvector(p * 255.0f + 0.5f, v4i);
+  if (lut) {
+    v4i k = __builtin_convertvector(p * ((1 << LUT_BITS) - 1) + 0.5f, v4i);
+    dst[0] = lut[k[0]];
+    dst[1] = lut[k[1]];
+    dst[2] = lut[k[2]];
   } else {
-    float *f_image = calloc(1, h * aa * w * 4 * sizeof(float));
-    while (read_polygon(&p)) rasterize(f_image, &p);
-
-    for (int y = 0; y < h; ++y) {
-      for (int x = 0; x < w; ++x) {
-        for (int c = 0; c < 4; ++c) {
-          float p = 0.0f;
-          for (int k = 0; k < aa; ++k) {
-            p += C(f_image, w, x, y * aa + k, c) / aa;
-          }
-          C(image, w, x, y, c) = p * 255.0f;
-        }
+    dst[0] = q[0];
+    dst[1] = q[1];
+    dst[2] = q[2];
+  }
+  dst[3] = q[3];
+}
+
+// Averages the aa sample rows of output row y over one tile column. When
+// every sample row lies in the same untouched or solid tile the average is
+// computed once and repeated.
+static void resolve_span(resolver *r, int y, int tx) {
+  static const float zero[4];
+  framebuffer *fb = r->fb;
+  int aa = r->aa, w = fb->w, x0 = tx * TILE;
+  const float *base[aa];
+  int stride[aa], uniform = 1;
+  for (int k = 0; k < aa; ++k) {
+    tile *t = tile_at(fb, x0, y * aa + k);
+    base[k] = t->state == tile_solid ? t->color : zero;
+    stride[k] = 0;
+    if (t->state == tile_mixed) {
+      base[k] = tile_pixel(t, x0, y * aa + k);
+      stride[k] = 4;
+      uniform = 0;
+    } else if (memcmp(base[k], base[0], 4 * sizeof(float)) != 0) {
+      uniform = 0;
+    }
+  }
+
+  int n = tile_at(fb, x0, 0)->w;
+  float inv = 1.0f / aa;
+  if (uniform) {
+    unsigned char pixel[4];
+    store4(pixel, load4(base[0]), r->lut);
+    for (int i = 0; i < n; ++i) memcpy(&C(r->image, w, x0 + i, y, 0), pixel, 4);
+    return;
+  }
+
+  for (int i = 0; i < n; ++i) {
+    v4 p = {0, 0, 0, 0};
+    for (int k = 0; k < aa; ++k) p += load4(base[k] + i * stride[k]);
+    store4(&C(r->image, w, x0 + i, y, 0), p * inv, r->lut);
+  }
+}
+
+static void *resolve_rows(void *arg) {
+  resolver *r = arg;
+  enter_phase(phase_resolve);
+  for (int y = r->y0; y < r->y1; ++y) {
+    for (int tx = 0; tx < r->fb->tw; ++tx) resolve_span(r, y, tx);
+  }
+  leave_phase();
+  return NULL;
+}
+
+static const unsigned char *gamma_lut(float gamma) {
+  static _Thread_local unsigned char lut[1 << LUT_BITS];
+  static _Thread_local float built;
+  if (!gamma) return NULL;
+  if (built != gamma) {
+    for (int i = 0; i < 1 << LUT_BITS; ++i) {
+      float v = encode_gamma(gamma, i / (float)((1 << LUT_BITS) - 1));
+      lut[i] = v * 255.0f + 0.5f;
+    }
+    built = gamma;
+  }
+  return lut;
+}
+
+static void resolve(raster_options *o, framebuffer *fb, unsigned char *image,
+                    int h) {
+  int n = o->threads < 1 ? 1 : o->threads;
+  if (n > h) n = h;
+  resolver r[n];
+  pthread_t threads[n];
+  for (int i = 0; i < n; ++i) {
+    r[i] = (resolver){.fb = fb, .image = image, .aa = o->aa};
+    r[i].y0 = (long)h * i / n;
+    r[i].y1 = (long)h * (i + 1) / n;
+    r[i].lut = gamma_lut(o->gamma);
+  }
+  for (int i = 1; i < n; ++i) {
+    start_worker(&threads[i], resolve_rows, &r[i]);
+  }
+  resolve_rows(&r[0]);
+  for (int i = 1; i < n; ++i) join_worker(threads[i]);
+}
+
+static void finish_image(raster_options *o, framebuffer *fb,
+                         unsigned char *image, int w, int h, FILE *out) {
+  building.left = 0;
+  while (fb->layer) pop_layer(fb);
+  while (fb->clip) pop_clip(fb);
+
+  if (!o->debug) {
+    enter_phase(phase_resolve);
+    settle_all(fb);
+    resolve(o, fb, image, h);
+    free_tiles(fb);
+    leave_phase();
+  }
+
+  enter_phase(phase_encode);
+  write_bmp(image, w, h, out);
+  leave_phase();
+}
+
+// A preview is drawn at 1/PREVIEW_SHRINK of the scale with one sample per
+// pixel, dropping vertices that stay within a preview pixel of the last one
+// kept, and goes to its own file.
+#define PREVIEW_SHRINK 2
+
+static FILE *open_preview(raster_options *o) {
+  FILE *f = fopen(o->preview, "wb");
+  if (!f) {
+    fprintf(stderr, "rasterize: cannot write %s\n", o->preview);
+    exit(1);
+  }
+  return f;
+}
+
+static void write_preview(raster_options *o, polygon_set *s, int w, int h) {
+  FILE *f = open_preview(o);
+  raster_options p = *o;
+  float scale = o->scale / (float)PREVIEW_SHRINK;
+  p.aa = 1;
+  p.tolerance = 1;
+  p.width = ceilf(w * scale);
+  p.height = ceilf(h * scale);
+  render_region(&p, s, scale, o->crop_x, o->crop_y, f);
+  fclose(f);
+  mark_first_image();
+}
+
+// Copies p scaled from device space to preview pixels.
+static void shrink_polygon(raster_options *o, polygon *p, polygon *q) {
+  float kx = 1.0f / PREVIEW_SHRINK, ky = kx / o->aa;
+  q->kind = p->kind;
+  q->color = p->color;
+  q->n = p->n;
+  q->alpha = p->alpha;
+  for (int i = 0; i < 4; ++i) q->box[i] = p->box[i] * (i % 2 ? ky : kx);
+  clear(&q->vertices);
+  float lx = 0, ly = 0;
+  for (point *v = p->vertices.head; v; v = v->next) {
+    float x = v->x * kx, y = v->y * ky;
+    if (v != p->vertices.head && v->next && fabsf(x - lx) < 1 &&
+        fabsf(y - ly) < 1)
+      continue;
+    lx = x;
+    ly = y;
+    add_point(&q->vertices, x, y);
+  }
+}
+
+static void write_kept_preview(raster_options *o, polygon *kept, int n,
+                               int w, int h) {
+  static _Thread_local unsigned char *image;
+  static _Thread_local size_t image_capacity;
+
+  FILE *f = open_preview(o);
+  raster_options p = *o;
+  p.aa = 1;
+  p.scale = 1;
+  p.width = (w + PREVIEW_SHRINK - 1) / PREVIEW_SHRINK;
+  p.height = (h + PREVIEW_SHRINK - 1) / PREVIEW_SHRINK;
+  image = reserve(image, &image_capacity, (size_t)p.width * p.height * 4);
+
+  framebuffer fb = {0};
+  init_framebuffer(&fb, p.width, p.height);
+  polygon q = {0};
+  for (int i = 0; i < n; ++i) {
+    shrink_polygon(o, &kept[i], &q);
+    draw_polygon(&p, image, &fb, &q);
+  }
+  clear(&q.vertices);
+  finish_image(&p, &fb, image, p.width, p.height, f);
+  fclose(f);
+  mark_first_image();
+}
+
+// Reads the whole stream into device-space polygons, which both the preview
+// and the full image are drawn from.
+static polygon *read_kept(raster_options *o, FILE *in, int *n) {
+  polygon *kept = NULL;
+  int capacity = 0;
+  for (*n = 0;; ++*n) {
+    if (*n == capacity) {
+      capacity = capacity ? 2 * capacity : 1024;
+      kept = realloc(kept, capacity * sizeof(polygon));
+      if (!kept) exit(1);
+    }
+    kept[*n] = (polygon){0};
+    if (!read_polygon(o, in, &kept[*n])) break;
+  }
+  return kept;
+}
+
+// With an index the whole stream is loaded first and only the polygons
+// meeting the crop window are rasterized.
+static void rasterize_indexed(raster_options *o, FILE *in, FILE *out) {
+  polygon_set *s = load_polygons(in);
+  raster_options c = *o;
+  int w, h;
+  if (c.crop_w > 0 && c.crop_h > 0) {
+    w = c.crop_w;
+    h = c.crop_h;
+  } else {
+    polygon_set_size(s, &w, &h);
+    c.crop_x = c.crop_y = 0;
+  }
+  if (c.preview) write_preview(&c, s, w, h);
+  c.width = w * c.scale;
+  c.height = h * c.scale;
+  render_region(&c, s, c.scale, c.crop_x, c.crop_y, out);
+  free_polygons(s);
+}
+
+void rasterize_polygons(raster_options *options, FILE *in, FILE *out) {
+  static _Thread_local unsigned char *image;
+  static _Thread_local size_t image_capacity;
+
+  if (options->index) {
+    rasterize_indexed(options, in, out);
+    return;
+  }
+
+  raster_options c = *options, *o = &c;
+  c.width = c.height = 900;
+  fscanf(in, "size %d %d\n", &c.width, &c.height);
+  if (c.crop_w > 0 && c.crop_h > 0) {
+    c.width = c.crop_w;
+    c.height = c.crop_h;
+  } else {
+    c.crop_x = c.crop_y = 0;
+  }
+
+  int w = o->width * o->scale, h = o->height * o->scale, aa = o->aa;
+  image = reserve(image, &image_capacity, (size_t)h * w * 4);
+
+  polygon *kept = NULL;
+  int n_kept = 0;
+  if (o->preview && !o->debug) {
+    kept = read_kept(o, in, &n_kept);
+    write_kept_preview(o, kept, n_kept, w, h);
+  }
+
+  framebuffer fb = {0};
+  if (!o->debug) init_framebuffer(&fb, w, h * aa);
+
+  if (kept) {
+    for (int i = 0; i < n_kept; ++i) {
+      draw_polygon(o, image, &fb, &kept[i]);
+      clear(&kept[i].vertices);
+    }
+    free(kept);
+  } else if (o->pipeline) {
+    draw_pipelined(o, in, image, &fb);
+  } else {
+    polygon p = {0};
+    while (read_polygon(o, in, &p)) draw_polygon(o, image, &fb, &p);
+    clear(&p.vertices);
+  }
+
+  finish_image(o, &fb, image, w, h, out);
+}
+
+// Polygons kept in memory in paint order, with a uniform grid over their
+// bounding boxes. Each cell lists the polygons that touch it in ascending
+// order; polygons spanning more than LARGE_CELLS cells are kept on a
+// separate list and tested by box instead. Each polygon also records the
+// scope it was painted in, the innermost clip or layer in force. A scope
+// records the one it was opened inside; a clip lists its own polygons,
+// which are kept apart from the grid, and a layer keeps its opacity and
+// box.
+typedef struct scope {
+  int kind, parent, first, n;
+  float alpha, box[4];
+} scope;
+
+struct polygon_set {
+  int width, height;
+  int n, capacity;
+  int *color, *first, *count, *scope;
+  float (*box)[4];
+  scope *scopes;
+  int n_scopes, scope_capacity;
+  int *clip_first, *clip_count;
+  int n_clip_polygons, clip_polygon_capacity;
+  float *x, *y;
+  int n_points, point_capacity;
+  float x0, y0, cell;
+  int gw, gh;
+  int *cell_start, *cell_items;
+  int *large, n_large;
+  int *mark, stamp;
+  int *hits;
+};
+
+#define LARGE_CELLS 64
+
+static int cell_index(float v, int n) {
+  return v < 0 ? (v < -1 ? -1 : 0) : v < n ? (int)v : n;
+}
+
+// Cells meeting `box`, clamped to the grid; empty if the box misses it.
+static void cell_range(polygon_set *s, const float *box, int *c) {
+  c[0] = max(cell_index((box[0] - s->x0) / s->cell, s->gw), 0);
+  c[1] = max(cell_index((box[1] - s->y0) / s->cell, s->gh), 0);
+  c[2] = min(cell_index((box[2] - s->x0) / s->cell, s->gw), s->gw - 1);
+  c[3] = min(cell_index((box[3] - s->y0) / s->cell, s->gh), s->gh - 1);
+}
+
+static int is_large(int *c) {
+  return (long)(c[2] - c[0] + 1) * (c[3] - c[1] + 1) > LARGE_CELLS;
+}
+
+static void build_grid(polygon_set *s) {
+  float x1 = s->x0, y1 = s->y0;
+  for (int i = 0; i < s->n; ++i) {
+    x1 = max(x1, s->box[i][2]);
+    y1 = max(y1, s->box[i][3]);
+  }
+  float w = max(x1 - s->x0, 1), h = max(y1 - s->y0, 1);
+  s->cell = max(sqrtf(w * h / (s->n + 1)), max(w, h) / 1024);
+  s->gw = w / s->cell + 1;
+  s->gh = h / s->cell + 1;
+
+  int n_cells = s->gw * s->gh;
+  s->cell_start = calloc(n_cells + 1, sizeof(int));
+  s->large = malloc((s->n + 1) * sizeof(int));
+  if (!s->cell_start || !s->large) exit(1);
+
+  int c[4];
+  for (int i = 0; i < s->n; ++i) {
+    cell_range(s, s->box[i], c);
+    if (is_large(c)) continue;
+    for (int y = c[1]; y <= c[3]; ++y) {
+      for (int x = c[0]; x <= c[2]; ++x) ++s->cell_start[y * s->gw + x + 1];
+    }
+  }
+  for (int i = 0; i < n_cells; ++i) s->cell_start[i + 1] += s->cell_start[i];
+
+  int *next = malloc(n_cells * sizeof(int));
+  s->cell_items = malloc((s->cell_start[n_cells] + 1) * sizeof(int));
+  if (!next || !s->cell_items) exit(1);
+  memcpy(next, s->cell_start, n_cells * sizeof(int));
+  for (int i = 0; i < s->n; ++i) {
+    cell_range(s, s->box[i], c);
+    if (is_large(c)) {
+      s->large[s->n_large++] = i;
+      continue;
+    }
+    for (int y = c[1]; y <= c[3]; ++y) {
+      for (int x = c[0]; x <= c[2]; ++x) {
+        s->cell_items[next[y * s->gw + x]++] = i;
       }
     }
-    write_bmp(image, w, h, "out.bmp");
-    free(f_image);
   }
-  free(image);
+  free(next);
+
+  s->mark = calloc(s->n + 1, sizeof(int));
+  s->hits = malloc((s->n + 1) * sizeof(int));
+  if (!s->mark || !s->hits) exit(1);
+}
+
+polygon_set *load_polygons(FILE *in) {
+  polygon_set *s = calloc(1, sizeof(polygon_set));
+  if (!s) exit(1);
+  s->width = s->height = 900;
+  fscanf(in, "size %d %d\n", &s->width, &s->height);
+
+  enter_phase(phase_read);
+  int kind, color, n, in_force = -1, reading = -1, left = 0;
+  float v[5];
+  while ((kind = read_record(in, &color, &n, v)) != record_end) {
+    if (kind == record_pop_clip || kind == record_pop_layer) {
+      if (in_force < 0) exit(1);
+      in_force = s->scopes[in_force].parent;
+      continue;
+    }
+    if (kind == record_push_clip || kind == record_push_layer) {
+      if (left) exit(1);
+      if (s->n_scopes == s->scope_capacity) {
+        s->scope_capacity = s->scope_capacity ? 2 * s->scope_capacity : 16;
+        s->scopes = realloc(s->scopes, s->scope_capacity * sizeof(scope));
+        if (!s->scopes) exit(1);
+      }
+      scope *c = &s->scopes[s->n_scopes];
+      *c = (scope){.kind = kind, .parent = in_force};
+      c->first = s->n_clip_polygons;
+      if (kind == record_push_layer) {
+        c->alpha = v[0];
+        memcpy(c->box, v + 1, sizeof(c->box));
+        in_force = s->n_scopes++;
+        continue;
+      }
+      c->n = left = n;
+      reading = s->n_scopes++;
+      if (!left) in_force = reading;
+      continue;
+    }
+    if (s->n == s->capacity) {
+      s->capacity = s->capacity ? 2 * s->capacity : 1024;
+      s->color = realloc(s->color, s->capacity * sizeof(int));
+      s->first = realloc(s->first, s->capacity * sizeof(int));
+      s->count = realloc(s->count, s->capacity * sizeof(int));
+      s->scope = realloc(s->scope, s->capacity * sizeof(int));
+      s->box = realloc(s->box, s->capacity * sizeof(*s->box));
+      if (!s->color || !s->first || !s->count || !s->scope || !s->box) exit(1);
+    }
+    if (left && s->n_clip_polygons == s->clip_polygon_capacity) {
+      int k = s->clip_polygon_capacity = 2 * s->clip_polygon_capacity + 16;
+      s->clip_first = realloc(s->clip_first, k * sizeof(int));
+      s->clip_count = realloc(s->clip_count, k * sizeof(int));
+      if (!s->clip_first || !s->clip_count) exit(1);
+    }
+    if (s->n_points + n > s->point_capacity) {
+      s->point_capacity = 2 * (s->n_points + n);
+      s->x = realloc(s->x, s->point_capacity * sizeof(float));
+      s->y = realloc(s->y, s->point_capacity * sizeof(float));
+      if (!s->x || !s->y) exit(1);
+    }
+    float *box = s->box[s->n];
+    box[0] = box[1] = INFINITY;
+    box[2] = box[3] = -INFINITY;
+    for (int k = 0; k < n; ++k) {
+      float x, y;
+      fscanf(in, "%f %f\n", &x, &y);
+      s->x[s->n_points + k] = x;
+      s->y[s->n_points + k] = y;
+      box[0] = min(box[0], x);
+      box[1] = min(box[1], y);
+      box[2] = max(box[2], x);
+      box[3] = max(box[3], y);
+    }
+    if (left) {
+      s->clip_first[s->n_clip_polygons] = s->n_points;
+      s->clip_count[s->n_clip_polygons++] = n;
+      s->n_points += n;
+      if (--left == 0) in_force = reading;
+    } else if (n > 0) {
+      if (!s->n || box[0] < s->x0) s->x0 = box[0];
+      if (!s->n || box[1] < s->y0) s->y0 = box[1];
+      s->color[s->n] = color;
+      s->first[s->n] = s->n_points;
+      s->count[s->n] = n;
+      s->scope[s->n] = in_force;
+      s->n_points += n;
+      ++s->n;
+    }
+  }
+  leave_phase();
+
+  enter_phase(phase_edge_build);
+  build_grid(s);
+  leave_phase();
+  return s;
+}
+
+void free_polygons(polygon_set *s) {
+  free(s->color);
+  free(s->first);
+  free(s->count);
+  free(s->scope);
+  free(s->box);
+  free(s->scopes);
+  free(s->clip_first);
+  free(s->clip_count);
+  free(s->x);
+  free(s->y);
+  free(s->cell_start);
+  free(s->cell_items);
+  free(s->large);
+  free(s->mark);
+  free(s->hits);
+  free(s);
+}
+
+int polygon_set_size(polygon_set *s, int *width, int *height) {
+  *width = s->width;
+  *height = s->height;
+  return s->n;
+}
+
+static int by_index(const void *a, const void *b) {
+  return *(const int *)a - *(const int *)b;
+}
+
+static int overlaps(const float *a, const float *b) {
+  return a[0] <= b[2] && b[0] <= a[2] && a[1] <= b[3] && b[1] <= a[3];
+}
+
+// Returns the polygons whose boxes meet `box`, in paint order.
+static int query(polygon_set *s, const float *box) {
+  int n = 0, c[4];
+  if (++s->stamp == 0) {
+    memset(s->mark, 0, s->n * sizeof(int));
+    s->stamp = 1;
+  }
+  cell_range(s, box, c);
+  for (int y = c[1]; y <= c[3]; ++y) {
+    for (int x = c[0]; x <= c[2]; ++x) {
+      int cell = y * s->gw + x;
+      for (int k = s->cell_start[cell]; k < s->cell_start[cell + 1]; ++k) {
+        int i = s->cell_items[k];
+        if (s->mark[i] == s->stamp || !overlaps(s->box[i], box)) continue;
+        s->mark[i] = s->stamp;
+        s->hits[n++] = i;
+      }
+    }
+  }
+  for (int k = 0; k < s->n_large; ++k) {
+    if (overlaps(s->box[s->large[k]], box)) s->hits[n++] = s->large[k];
+  }
+  qsort(s->hits, n, sizeof(int), by_index);
+  return n;
+}
+
+// Maps document points into a render window, dropping interior vertices
+// that stay within `tolerance` pixels of the last one kept.
+typedef struct window {
+  polygon_set *s;
+  float x, y, scale;
+  int aa, debug;
+  float tolerance;
+} window;
+
+static void window_vertices(window *w, int first, int n, polygon *p) {
+  polygon_set *s = w->s;
+  float d = w->tolerance, kx = 0, ky = 0;
+  int last = first + n - 1;
+  clear(&p->vertices);
+  for (int j = first; j <= last; ++j) {
+    float px = (s->x[j] - w->x) * w->scale, py = (s->y[j] - w->y) * w->scale;
+    if (d > 0 && j > first && j < last && fabsf(px - kx) < d &&
+        fabsf(py - ky) < d)
+      continue;
+    kx = px;
+    ky = py;
+    add_point(&p->vertices, px, w->debug ? py : py * w->aa);
+  }
+}
+
+static int inside(polygon_set *s, int k, int outer) {
+  for (; k >= 0; k = s->scopes[k].parent) {
+    if (k == outer) return 1;
+  }
+  return outer < 0;
+}
+
+// Opens scope k after the scopes it lies in, up to the open scope `from`.
+static void open_scopes(window *w, raster_options *o, framebuffer *fb,
+                        int from, int k, polygon *p) {
+  if (k == from) return;
+  scope *c = &w->s->scopes[k];
+  open_scopes(w, o, fb, from, c->parent, p);
+  p->kind = c->kind;
+  p->n = c->n;
+  p->alpha = c->alpha;
+  float sy = w->debug ? w->scale : w->scale * w->aa;
+  p->box[0] = (c->box[0] - w->x) * w->scale;
+  p->box[1] = (c->box[1] - w->y) * sy;
+  p->box[2] = (c->box[2] - w->x) * w->scale;
+  p->box[3] = (c->box[3] - w->y) * sy;
+  draw_polygon(o, NULL, fb, p);
+  p->kind = record_polygon;
+  for (int j = c->first; j < c->first + c->n; ++j) {
+    window_vertices(w, w->s->clip_first[j], w->s->clip_count[j], p);
+    draw_polygon(o, NULL, fb, p);
+  }
+}
+
+// Closes the open scopes that scope `to` does not lie in, then opens the
+// rest of the way down to it. Polygons come in paint order, so a layer is
+// never left and entered again.
+static void change_scope(window *w, raster_options *o, framebuffer *fb,
+                         int from, int to, polygon *p) {
+  for (; !inside(w->s, to, from); from = w->s->scopes[from].parent) {
+    int kind = w->s->scopes[from].kind;
+    p->kind = kind == record_push_clip ? record_pop_clip : record_pop_layer;
+    draw_polygon(o, NULL, fb, p);
+  }
+  open_scopes(w, o, fb, from, to, p);
+  p->kind = record_polygon;
+}
+
+// Renders the o->width x o->height pixel window whose top left corner is
+// document point (x, y), at `scale` pixels per document unit.
+void render_region(raster_options *options, polygon_set *s, float scale,
+                   float x, float y, FILE *out) {
+  static _Thread_local unsigned char *image;
+  static _Thread_local size_t image_capacity;
+
+  raster_options c = *options, *o = &c;
+  c.scale = 1;
+  int w = o->width, h = o->height, aa = o->aa;
+  image = reserve(image, &image_capacity, (size_t)h * w * 4);
+
+  framebuffer fb = {0};
+  if (!o->debug) init_framebuffer(&fb, w, h * aa);
+
+  float margin = 1 / scale;
+  float box[4] = {x - margin, y - margin, x + w / scale + margin,
+                  y + h / scale + margin};
+  int n = query(s, box);
+
+  polygon p = {.kind = record_polygon};
+  window view = {s, x, y, scale, aa, o->debug, o->tolerance};
+  int in_force = -1;
+  for (int k = 0; k < n; ++k) {
+    int i = s->hits[k];
+    if (s->scope[i] != in_force) {
+      change_scope(&view, o, &fb, in_force, s->scope[i], &p);
+      in_force = s->scope[i];
+    }
+    count(count_polygons, 1);
+    window_vertices(&view, s->first[i], s->count[i], &p);
+    p.color = s->color[i];
+    draw_polygon(o, image, &fb, &p);
+  }
+  clear(&p.vertices);
+
+  finish_image(o, &fb, image, w, h, out);
+}
+
+#ifndef NO_MAIN
+int main(int argc, char *argv[]) {
+  argc = stats_option(argc, argv);
+
+  raster_options o = {.scale = 1, .aa = 1, .debug = 0};
+  int n = 0;
+  for (int i = 1; i < argc; ++i) {
+    if (strcmp(argv[i], "--fixed") == 0)
+      o.fixed = 1;
+    else if (strcmp(argv[i], "--pipeline") == 0)
+      o.pipeline = 1;
+    else if (strcmp(argv[i], "--index") == 0)
+      o.index = 1;
+    else if (strcmp(argv[i], "--preview") == 0 && i + 1 < argc)
+      o.preview = argv[++i];
+    else if (strcmp(argv[i], "--crop") == 0 && i + 1 < argc)
+      sscanf(argv[++i], "%d,%d,%d,%d", &o.crop_x, &o.crop_y, &o.crop_w,
+             &o.crop_h);
+    else if (strcmp(argv[i], "-j") == 0 && i + 1 < argc)
+      sscanf(argv[++i], "%d", &o.threads);
+    else if (strcmp(argv[i], "--gamma") == 0 && i + 1 < argc)
+      o.gamma = strcmp(argv[++i], "srgb") == 0 ? -1 : atof(argv[i]);
+    else
+      argv[++n] = argv[i];
+  }
+  if (n >= 1) sscanf(argv[1], "%d", &o.scale);
+  if (n >= 2) sscanf(argv[2], "%d", &o.aa);
+  if (n >= 3) sscanf(argv[3], "%d", &o.debug);
+
+  rasterize_polygons(&o, stdin, stdout);
+  if (run_stats.enabled) print_stats(stderr, "rasterize", NULL);
   return 0;
 }
+#endif
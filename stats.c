@@ -0,0 +1,158 @@
+#include "stats.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+_Thread_local stats run_stats;
+
+static const char *phase_names[] = {
+    "tokenize", "dom_build", "emit",       "optimize",     "interpret", "flatten",
+    "stroke",   "read",      "edge_build", "scan_convert", "resolve",   "encode",
+};
+
+static const char *counter_names[] = {
+    "tokens", "emitted", "removed", "commands", "curves", "simplified",
+    "instances", "symbols", "polygons", "clips", "layers", "edges", "spans",
+    "pixels", "tiles", "queue_depth", "read_stalls", "raster_stalls",
+};
+
+static double seconds(clockid_t clock) {
+  struct timespec t;
+  clock_gettime(clock, &t);
+  return t.tv_sec + t.tv_nsec * 1e-9;
+}
+
+int stats_option(int argc, char *argv[]) {
+  run_stats.start = seconds(CLOCK_MONOTONIC);
+  int n = 1;
+  for (int i = 1; i < argc; ++i) {
+    if (strcmp(argv[i], "--stats") == 0)
+      run_stats.enabled = 1;
+    else
+      argv[n++] = argv[i];
+  }
+  argv[n] = NULL;
+  return n;
+}
+
+void reset_stats(void) {
+  int enabled = run_stats.enabled;
+  memset(&run_stats, 0, sizeof(stats));
+  run_stats.enabled = enabled;
+  run_stats.start = seconds(CLOCK_MONOTONIC);
+}
+
+// Wall time from the start of the run until a first (preview) image was
+// written.
+void mark_first_image(void) {
+  run_stats.first_image = seconds(CLOCK_MONOTONIC) - run_stats.start;
+}
+
+// Phase times add up across threads, so under -j a phase can take longer
+// than the run.
+void merge_stats(stats *into, const stats *from) {
+  for (int i = 0; i < n_phases; ++i) {
+    into->wall[i] += from->wall[i];
+    into->cpu[i] += from->cpu[i];
+  }
+  for (int i = 0; i < n_counters; ++i) into->counts[i] += from->counts[i];
+  if (!into->first_image) into->first_image = from->first_image;
+}
+
+typedef struct worker {
+  void *(*f)(void *);
+  void *arg;
+  int enabled;
+  stats result;
+} worker;
+
+static void *run_worker(void *arg) {
+  worker *w = arg;
+  run_stats.enabled = w->enabled;
+  run_stats.start = seconds(CLOCK_MONOTONIC);
+  w->f(w->arg);
+  w->result = run_stats;
+  return w;
+}
+
+void start_worker(pthread_t *t, void *(*f)(void *), void *arg) {
+  worker *w = malloc(sizeof(worker));
+  if (!w) exit(1);
+  *w = (worker){.f = f, .arg = arg, .enabled = run_stats.enabled};
+  if (pthread_create(t, NULL, run_worker, w)) exit(1);
+}
+
+void join_worker(pthread_t t) {
+  worker *w;
+  pthread_join(t, (void **)&w);
+  merge_stats(&run_stats, &w->result);
+  free(w);
+}
+
+void switch_phase(int push, phase p) {
+  stats *s = &run_stats;
+  double wall = seconds(CLOCK_MONOTONIC);
+  double cpu = seconds(CLOCK_THREAD_CPUTIME_ID);
+
+  if (s->depth) {
+    phase cur = s->stack[s->depth - 1];
+    s->wall[cur] += wall - s->wall_mark;
+    s->cpu[cur] += cpu - s->cpu_mark;
+  }
+  s->wall_mark = wall;
+  s->cpu_mark = cpu;
+
+  if (!push) {
+    if (s->depth) --s->depth;
+  } else if (s->depth < (int)(sizeof(s->stack) / sizeof(phase))) {
+    s->stack[s->depth++] = p;
+  }
+}
+
+static void put_string(FILE *f, const char *s) {
+  fputc('"', f);
+  for (; *s; ++s) {
+    unsigned char c = *s;
+    if (c == '"' || c == '\\')
+      fprintf(f, "\\%c", c);
+    else if (c < 0x20)
+      fprintf(f, "\\u%04x", c);
+    else
+      fputc(c, f);
+  }
+  fputc('"', f);
+}
+
+// The line is built in memory and written with one call, so lines from
+// concurrent documents do not interleave.
+void print_stats(FILE *f, const char *tool, const char *input) {
+  char *line = NULL;
+  size_t size = 0;
+  FILE *s = open_memstream(&line, &size);
+  fprintf(s, "{\"tool\":\"%s\"", tool);
+  if (input) {
+    fprintf(s, ",\"input\":");
+    put_string(s, input);
+  }
+
+  fprintf(s, ",\"phases\":{");
+  for (int i = 0; i < n_phases; ++i) {
+    fprintf(s, "%s\"%s\":{\"wall\":%.6f,\"cpu\":%.6f}", i ? "," : "",
+            phase_names[i], run_stats.wall[i], run_stats.cpu[i]);
+  }
+  fprintf(s, "}");
+  fprintf(s, ",\"elapsed\":%.6f", seconds(CLOCK_MONOTONIC) - run_stats.start);
+  if (run_stats.first_image) {
+    fprintf(s, ",\"first_image\":%.6f", run_stats.first_image);
+  }
+  fprintf(s, ",\"counts\":{");
+  for (int i = 0; i < n_counters; ++i) {
+    fprintf(s, "%s\"%s\":%ld", i ? "," : "", counter_names[i],
+            run_stats.counts[i]);
+  }
+  fprintf(s, "}}\n");
+  fclose(s);
+  fputs(line, f);
+  free(line);
+}
@@ -0,0 +1,74 @@
+#include <pthread.h>
+#include <stdio.h>
+
+typedef enum phase {
+  phase_tokenize,
+  phase_dom_build,
+  phase_emit,
+  phase_optimize,
+  phase_interpret,
+  phase_flatten,
+  phase_stroke,
+  phase_read,
+  phase_edge_build,
+  phase_scan_convert,
+  phase_resolve,
+  phase_encode,
+  n_phases,
+} phase;
+
+typedef enum counter {
+  count_tokens,
+  count_emitted,
+  count_removed,
+  count_commands,
+  count_curves,
+  count_simplified,
+  count_instances,
+  count_symbols,
+  count_polygons,
+  count_clips,
+  count_layers,
+  count_edges,
+  count_spans,
+  count_pixels,
+  count_tiles,
+  count_queue_depth,
+  count_read_stalls,
+  count_raster_stalls,
+  n_counters,
+} counter;
+
+typedef struct stats {
+  int enabled;
+  int depth;
+  phase stack[16];
+  double wall_mark, cpu_mark;
+  double start, first_image;
+  double wall[n_phases], cpu[n_phases];
+  long counts[n_counters];
+} stats;
+
+extern _Thread_local stats run_stats;
+
+int stats_option(int argc, char *argv[]);
+void reset_stats(void);
+void switch_phase(int push, phase p);
+void mark_first_image(void);
+void merge_stats(stats *into, const stats *from);
+void print_stats(FILE *f, const char *tool, const char *input);
+
+// Threads started with start_worker collect stats when their creator does;
+// join_worker adds them into the creator's.
+void start_worker(pthread_t *t, void *(*f)(void *), void *arg);
+void join_worker(pthread_t t);
+
+static inline void enter_phase(phase p) {
+  if (run_stats.enabled) switch_phase(1, p);
+}
+
+static inline void leave_phase(void) {
+  if (run_stats.enabled) switch_phase(0, 0);
+}
+
+static inline void count(counter c, long n) { run_stats.counts[c] += n; }
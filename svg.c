@@ -0,0 +1,642 @@
+#include <dirent.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "stats.h"
+#include "svg.h"
+
+static const char *cache_dir;
+
+// Bumped whenever the scene format or how it is produced changes, so stale
+// cache entries are never read back.
+#define SCENE_VERSION 3
+
+static char *build_scene(FILE *in, int scale, size_t *n) {
+  char *cmds = NULL, *scene = NULL;
+  size_t n_cmds = 0;
+
+  FILE *s = open_memstream(&cmds, &n_cmds);
+  compile_svg(in, s);
+  fclose(s);
+
+  FILE *t = open_memstream(&scene, n);
+  s = fmemopen(cmds, n_cmds, "r");
+  interpret_commands(s, t, scale);
+  fclose(s);
+  fclose(t);
+
+  free(cmds);
+  return scene;
+}
+
+static char *read_all(FILE *in, size_t *n) {
+  char *data = NULL, buffer[65536];
+  FILE *s = open_memstream(&data, n);
+  for (size_t k; (k = fread(buffer, 1, sizeof(buffer), in));) {
+    fwrite(buffer, 1, k, s);
+  }
+  fclose(s);
+  return data;
+}
+
+static uint64_t hash(uint64_t h, const char *data, size_t n) {
+  for (size_t i = 0; i < n; ++i) {
+    h ^= (unsigned char)data[i];
+    h *= 0x100000001b3;
+  }
+  return h;
+}
+
+static char *load_scene(const char *path, int scale, size_t *n) {
+  FILE *f = fopen(path, "rb");
+  if (!f) return NULL;
+
+  int flattened_at, k = 0;
+  if (fscanf(f, "%d\n%n", &flattened_at, &k) != 1 || !k ||
+      flattened_at < scale) {
+    fclose(f);
+    return NULL;
+  }
+  char *scene = read_all(f, n);
+  fclose(f);
+  return scene;
+}
+
+static void store_scene(const char *path, int scale, char *scene, size_t n) {
+  char *tmp = malloc(strlen(path) + 2 + 2 * sizeof(long));
+  sprintf(tmp, "%s.%lx", path, (unsigned long)pthread_self());
+
+  FILE *f = fopen(tmp, "wb");
+  if (f) {
+    fprintf(f, "%d\n", scale);
+    fwrite(scene, 1, n, f);
+    if (fclose(f) == 0) rename(tmp, path);
+  }
+  free(tmp);
+}
+
+static char *cached_scene(FILE *in, int scale, size_t *n) {
+  size_t n_src;
+  char *src = read_all(in, &n_src);
+
+  // The key covers the format and the interpret settings as well as the
+  // document, since each changes the scene.
+  char key[64];
+  int k = snprintf(key, sizeof(key), "scene %d %g %d\n", SCENE_VERSION,
+                   simplify, batched);
+  uint64_t h = hash(0xcbf29ce484222325, key, k);
+  char *path = malloc(strlen(cache_dir) + 24);
+  sprintf(path, "%s/%016llx.scene", cache_dir,
+          (unsigned long long)hash(h, src, n_src));
+
+  char *scene = load_scene(path, scale, n);
+  if (!scene) {
+    FILE *s = fmemopen(src, n_src, "r");
+    scene = build_scene(s, scale, n);
+    fclose(s);
+    store_scene(path, scale, scene, *n);
+  }
+  free(path);
+  free(src);
+  return scene;
+}
+
+static void render(raster_options *o, FILE *in, FILE *out) {
+  size_t n;
+  char *scene = cache_dir ? cached_scene(in, o->scale, &n)
+                          : build_scene(in, o->scale, &n);
+
+  FILE *s = fmemopen(scene, n, "r");
+  rasterize_polygons(o, s, out);
+  fclose(s);
+  free(scene);
+}
+
+typedef struct job {
+  char *src;
+  char *dst;
+  double latency;
+} job;
+
+typedef struct job_list {
+  job *jobs;
+  int n;
+  int capacity;
+} job_list;
+
+typedef struct batch {
+  raster_options *options;
+  job_list *list;
+  int next;
+  pthread_mutex_t lock;
+} batch;
+
+static double now(void) {
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec + t.tv_nsec * 1e-9;
+}
+
+static int has_suffix(const char *s, const char *suffix) {
+  size_t n = strlen(s), m = strlen(suffix);
+  return n >= m && strcmp(s + n - m, suffix) == 0;
+}
+
+static char *output_path(const char *src, const char *dir) {
+  const char *name = src;
+  if (dir) {
+    const char *slash = strrchr(src, '/');
+    if (slash) name = slash + 1;
+  } else {
+    dir = "";
+  }
+
+  size_t n = strlen(name);
+  if (has_suffix(name, ".svg")) n -= 4;
+
+  char *dst = malloc(strlen(dir) + n + 6);
+  sprintf(dst, "%s%s%.*s.bmp", dir, *dir ? "/" : "", (int)n, name);
+  return dst;
+}
+
+static void add_job(job_list *l, const char *src, const char *dir) {
+  if (l->n == l->capacity) {
+    l->capacity = l->capacity ? 2 * l->capacity : 64;
+    l->jobs = realloc(l->jobs, l->capacity * sizeof(job));
+    if (!l->jobs) exit(1);
+  }
+  l->jobs[l->n++] = (job){.src = strdup(src), .dst = output_path(src, dir)};
+}
+
+static int by_name(const void *a, const void *b) {
+  return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+static void add_jobs(job_list *l, const char *path, const char *dir) {
+  struct stat st;
+  if (stat(path, &st) != 0) {
+    fprintf(stderr, "svg: cannot open %s\n", path);
+    exit(1);
+  }
+  if (!S_ISDIR(st.st_mode)) {
+    add_job(l, path, dir);
+    return;
+  }
+
+  DIR *d = opendir(path);
+  if (!d) exit(1);
+
+  char **names = NULL;
+  int n = 0, capacity = 0;
+  for (struct dirent *e; (e = readdir(d));) {
+    if (!has_suffix(e->d_name, ".svg")) continue;
+    if (n == capacity) {
+      capacity = capacity ? 2 * capacity : 64;
+      names = realloc(names, capacity * sizeof(char *));
+      if (!names) exit(1);
+    }
+    names[n] = malloc(strlen(path) + strlen(e->d_name) + 2);
+    sprintf(names[n++], "%s/%s", path, e->d_name);
+  }
+  closedir(d);
+
+  qsort(names, n, sizeof(char *), by_name);
+  for (int i = 0; i < n; ++i) {
+    add_job(l, names[i], dir);
+    free(names[i]);
+  }
+  free(names);
+}
+
+// Each document's stats are printed on their own, then added to the
+// thread's totals, which run_batch collects when it joins.
+static void *worker(void *arg) {
+  batch *b = arg;
+  stats total = run_stats;
+  for (;;) {
+    pthread_mutex_lock(&b->lock);
+    int i = b->next++;
+    pthread_mutex_unlock(&b->lock);
+    if (i >= b->list->n) break;
+
+    job *j = &b->list->jobs[i];
+    double start = now();
+    reset_stats();
+
+    FILE *in = fopen(j->src, "r");
+    if (!in) {
+      fprintf(stderr, "svg: cannot open %s\n", j->src);
+      exit(1);
+    }
+    FILE *out = fopen(j->dst, "wb");
+    if (!out) {
+      fprintf(stderr, "svg: cannot write %s\n", j->dst);
+      exit(1);
+    }
+    render(b->options, in, out);
+    fclose(in);
+    fclose(out);
+
+    j->latency = now() - start;
+    if (run_stats.enabled) print_stats(stderr, "svg", j->src);
+    merge_stats(&total, &run_stats);
+  }
+  run_stats = total;
+  return NULL;
+}
+
+static int by_latency(const void *a, const void *b) {
+  double x = *(const double *)a, y = *(const double *)b;
+  return (x > y) - (x < y);
+}
+
+static double percentile(double *sorted, int n, double p) {
+  int i = p * (n - 1) + 0.5;
+  return sorted[i];
+}
+
+static void run_batch(raster_options *o, job_list *l, int n_threads) {
+  if (!l->n) return;
+
+  batch b = {.options = o, .list = l};
+  pthread_mutex_init(&b.lock, NULL);
+
+  if (n_threads > l->n) n_threads = l->n;
+  pthread_t *threads = calloc(n_threads, sizeof(pthread_t));
+
+  double start = now();
+  for (int i = 0; i < n_threads; ++i) {
+    start_worker(&threads[i], worker, &b);
+  }
+  for (int i = 0; i < n_threads; ++i) join_worker(threads[i]);
+  double elapsed = now() - start;
+  if (run_stats.enabled) print_stats(stderr, "svg", NULL);
+
+  double *latencies = calloc(l->n, sizeof(double));
+  for (int i = 0; i < l->n; ++i) latencies[i] = l->jobs[i].latency;
+  qsort(latencies, l->n, sizeof(double), by_latency);
+
+  fprintf(stderr,
+          "%d documents, %d threads, %.3fs (%.1f docs/s)\n"
+          "latency ms: p50 %.3f p90 %.3f p99 %.3f max %.3f\n",
+          l->n, n_threads, elapsed, l->n / elapsed,
+          percentile(latencies, l->n, 0.5) * 1e3,
+          percentile(latencies, l->n, 0.9) * 1e3,
+          percentile(latencies, l->n, 0.99) * 1e3,
+          latencies[l->n - 1] * 1e3);
+
+  free(latencies);
+  free(threads);
+  pthread_mutex_destroy(&b.lock);
+}
+
+#define TILE_SIZE 256
+#define TILE_BUCKETS 4096
+#define MAX_ZOOM 20
+#define MAX_LEVEL 4
+
+typedef struct cached_tile {
+  int zoom, x, y;
+  char *data;
+  size_t size;
+  struct cached_tile *prev, *next;
+  struct cached_tile *chain;
+} cached_tile;
+
+// Encoded tiles by (zoom, x, y), most recently used first; the least
+// recently used are evicted once the total size passes capacity.
+typedef struct tile_cache {
+  cached_tile *buckets[TILE_BUCKETS];
+  cached_tile *head, *tail;
+  size_t bytes, capacity;
+  int n;
+} tile_cache;
+
+static unsigned tile_bucket(int zoom, int x, int y) {
+  return ((unsigned)zoom * 0x9e3779b1u ^ (unsigned)x * 0x85ebca6bu ^
+          (unsigned)y * 0xc2b2ae35u) %
+         TILE_BUCKETS;
+}
+
+static void unlink_tile(tile_cache *c, cached_tile *t) {
+  if (t->prev)
+    t->prev->next = t->next;
+  else
+    c->head = t->next;
+  if (t->next)
+    t->next->prev = t->prev;
+  else
+    c->tail = t->prev;
+}
+
+static void push_tile(tile_cache *c, cached_tile *t) {
+  t->prev = NULL;
+  t->next = c->head;
+  if (c->head)
+    c->head->prev = t;
+  else
+    c->tail = t;
+  c->head = t;
+}
+
+static cached_tile *find_tile(tile_cache *c, int zoom, int x, int y) {
+  cached_tile *t = c->buckets[tile_bucket(zoom, x, y)];
+  while (t && !(t->zoom == zoom && t->x == x && t->y == y)) t = t->chain;
+  if (t) {
+    unlink_tile(c, t);
+    push_tile(c, t);
+  }
+  return t;
+}
+
+static void evict_tile(tile_cache *c) {
+  cached_tile *t = c->tail;
+  cached_tile **p = &c->buckets[tile_bucket(t->zoom, t->x, t->y)];
+  while (*p != t) p = &(*p)->chain;
+  *p = t->chain;
+  unlink_tile(c, t);
+  c->bytes -= t->size;
+  --c->n;
+  free(t->data);
+  free(t);
+}
+
+static void add_tile(tile_cache *c, int zoom, int x, int y, char *data,
+                     size_t size) {
+  cached_tile *t = calloc(1, sizeof(cached_tile));
+  if (!t) exit(1);
+  *t = (cached_tile){.zoom = zoom, .x = x, .y = y, .data = data, .size = size};
+  unsigned b = tile_bucket(zoom, x, y);
+  t->chain = c->buckets[b];
+  c->buckets[b] = t;
+  push_tile(c, t);
+  c->bytes += size;
+  ++c->n;
+  while (c->bytes > c->capacity && c->tail != t) evict_tile(c);
+}
+
+// The document is compiled once; each zoom level up to MAX_LEVEL is
+// interpreted (flattened) for its own scale the first time it is asked for,
+// deeper levels reuse the last one.
+typedef struct server {
+  raster_options options;
+  char *cmds;
+  size_t n_cmds;
+  polygon_set *levels[MAX_LEVEL + 1];
+  int width, height;
+  tile_cache cache;
+  double *latencies;
+  int n_requests, capacity, hits;
+} server;
+
+static polygon_set *level(server *sv, int zoom) {
+  int l = zoom < MAX_LEVEL ? zoom : MAX_LEVEL;
+  if (!sv->levels[l]) {
+    char *scene = NULL;
+    size_t n = 0;
+    FILE *t = open_memstream(&scene, &n);
+    FILE *s = fmemopen(sv->cmds, sv->n_cmds, "r");
+    interpret_commands(s, t, 1 << l);
+    fclose(s);
+    fclose(t);
+
+    s = fmemopen(scene, n, "r");
+    sv->levels[l] = load_polygons(s);
+    fclose(s);
+    free(scene);
+    polygon_set_size(sv->levels[l], &sv->width, &sv->height);
+  }
+  return sv->levels[l];
+}
+
+static void add_latency(server *sv, double latency) {
+  if (sv->n_requests == sv->capacity) {
+    sv->capacity = sv->capacity ? 2 * sv->capacity : 1024;
+    sv->latencies = realloc(sv->latencies, sv->capacity * sizeof(double));
+    if (!sv->latencies) exit(1);
+  }
+  sv->latencies[sv->n_requests++] = latency;
+}
+
+static void print_latencies(server *sv, FILE *out) {
+  int n = sv->n_requests;
+  double *sorted = malloc((n + 1) * sizeof(double));
+  if (!sorted) exit(1);
+  memcpy(sorted, sv->latencies, n * sizeof(double));
+  qsort(sorted, n, sizeof(double), by_latency);
+  fprintf(out,
+          "%d requests, %d hits, %d tiles cached (%zu bytes), "
+          "latency ms: p50 %.3f p90 %.3f p99 %.3f max %.3f\n",
+          n, sv->hits, sv->cache.n, sv->cache.bytes,
+          n ? percentile(sorted, n, 0.5) * 1e3 : 0,
+          n ? percentile(sorted, n, 0.9) * 1e3 : 0,
+          n ? percentile(sorted, n, 0.99) * 1e3 : 0,
+          n ? sorted[n - 1] * 1e3 : 0);
+  free(sorted);
+}
+
+static void serve_tile(server *sv, int zoom, int x, int y, FILE *out) {
+  double start = now();
+  polygon_set *s = zoom >= 0 && zoom <= MAX_ZOOM ? level(sv, zoom) : NULL;
+  long n = 1L << (zoom < 0 ? 0 : zoom);
+  if (!s || x < 0 || y < 0 || (long)x * TILE_SIZE >= sv->width * n ||
+      (long)y * TILE_SIZE >= sv->height * n) {
+    fprintf(out, "error no tile %d %d %d\n", zoom, x, y);
+    return;
+  }
+
+  cached_tile *t = find_tile(&sv->cache, zoom, x, y);
+  if (t) {
+    ++sv->hits;
+  } else {
+    char *data = NULL;
+    size_t size = 0;
+    FILE *f = open_memstream(&data, &size);
+    float scale = n;
+    render_region(&sv->options, s, scale, x * TILE_SIZE / scale,
+                  y * TILE_SIZE / scale, f);
+    fclose(f);
+    add_tile(&sv->cache, zoom, x, y, data, size);
+    t = sv->cache.head;
+  }
+  add_latency(sv, now() - start);
+  fprintf(out, "ok %zu\n", t->size);
+  fwrite(t->data, 1, t->size, out);
+}
+
+// One request per line: "tile Z X Y" answers "ok N" and N bytes of BMP (or
+// "error ..."), "stats" answers one line, "quit" stops the server. Returns
+// whether quit was asked for.
+static int serve_stream(server *sv, FILE *in, FILE *out) {
+  char line[256];
+  while (fgets(line, sizeof(line), in)) {
+    int zoom, x, y;
+    if (sscanf(line, "tile %d %d %d", &zoom, &x, &y) == 3) {
+      serve_tile(sv, zoom, x, y, out);
+    } else if (strncmp(line, "stats", 5) == 0) {
+      print_latencies(sv, out);
+    } else if (strncmp(line, "quit", 4) == 0) {
+      return 1;
+    } else {
+      fprintf(out, "error bad request\n");
+    }
+    fflush(out);
+  }
+  return 0;
+}
+
+static void serve_socket(server *sv, const char *path) {
+  struct sockaddr_un addr = {.sun_family = AF_UNIX};
+  if (strlen(path) >= sizeof(addr.sun_path)) exit(1);
+  strcpy(addr.sun_path, path);
+
+  signal(SIGPIPE, SIG_IGN);
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  unlink(path);
+  if (fd < 0 || bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+      listen(fd, 16) != 0) {
+    fprintf(stderr, "svg: cannot listen on %s\n", path);
+    exit(1);
+  }
+
+  for (int quit = 0; !quit;) {
+    int c = accept(fd, NULL, NULL);
+    if (c < 0) continue;
+    FILE *in = fdopen(c, "r"), *out = fdopen(dup(c), "w");
+    if (!in || !out) exit(1);
+    quit = serve_stream(sv, in, out);
+    fclose(in);
+    fclose(out);
+  }
+  close(fd);
+  unlink(path);
+}
+
+static void serve(raster_options *o, const char *path, const char *socket_path,
+                  size_t cache_bytes) {
+  FILE *in = fopen(path, "r");
+  if (!in) {
+    fprintf(stderr, "svg: cannot open %s\n", path);
+    exit(1);
+  }
+  server *sv = calloc(1, sizeof(server));
+  if (!sv) exit(1);
+  sv->options = *o;
+  sv->options.width = sv->options.height = TILE_SIZE;
+  sv->options.preview = NULL;
+  sv->cache.capacity = cache_bytes;
+
+  FILE *s = open_memstream(&sv->cmds, &sv->n_cmds);
+  compile_svg(in, s);
+  fclose(s);
+  fclose(in);
+  level(sv, 0);
+
+  if (socket_path)
+    serve_socket(sv, socket_path);
+  else
+    serve_stream(sv, stdin, stdout);
+  print_latencies(sv, stderr);
+
+  while (sv->cache.n) evict_tile(&sv->cache);
+  for (int i = 0; i <= MAX_LEVEL; ++i) {
+    if (sv->levels[i]) free_polygons(sv->levels[i]);
+  }
+  free(sv->latencies);
+  free(sv->cmds);
+  free(sv);
+}
+
+static int is_number(const char *s) {
+  if (!*s) return 0;
+  for (; *s; ++s)
+    if (*s < '0' || *s > '9') return 0;
+  return 1;
+}
+
+int main(int argc, char *argv[]) {
+  argc = stats_option(argc, argv);
+
+  raster_options o = {.scale = 1, .aa = 1, .debug = 0};
+  int n_threads = sysconf(_SC_NPROCESSORS_ONLN), n_numbers = 0, n_paths = 0;
+  int serving = 0, cache_mb = 64;
+  char *dir = NULL, *socket_path = NULL;
+  char **paths = calloc(argc, sizeof(char *));
+
+  for (int i = 1; i < argc; ++i) {
+    if (strcmp(argv[i], "-j") == 0 && i + 1 < argc) {
+      sscanf(argv[++i], "%d", &n_threads);
+    } else if (strcmp(argv[i], "-o") == 0 && i + 1 < argc) {
+      dir = argv[++i];
+    } else if (strcmp(argv[i], "--fixed") == 0) {
+      o.fixed = 1;
+    } else if (strcmp(argv[i], "--pipeline") == 0) {
+      o.pipeline = 1;
+    } else if (strcmp(argv[i], "--index") == 0) {
+      o.index = 1;
+    } else if (strcmp(argv[i], "--batch") == 0) {
+      batched = 1;
+    } else if (strcmp(argv[i], "--simplify") == 0 && i + 1 < argc) {
+      sscanf(argv[++i], "%f", &simplify);
+    } else if (strcmp(argv[i], "--preview") == 0 && i + 1 < argc) {
+      o.preview = argv[++i];
+    } else if (strcmp(argv[i], "--gamma") == 0 && i + 1 < argc) {
+      o.gamma = strcmp(argv[++i], "srgb") == 0 ? -1 : atof(argv[i]);
+    } else if (strcmp(argv[i], "--crop") == 0 && i + 1 < argc) {
+      sscanf(argv[++i], "%d,%d,%d,%d", &o.crop_x, &o.crop_y, &o.crop_w,
+             &o.crop_h);
+    } else if (strcmp(argv[i], "--serve") == 0) {
+      serving = 1;
+    } else if (strcmp(argv[i], "--socket") == 0 && i + 1 < argc) {
+      socket_path = argv[++i];
+    } else if (strcmp(argv[i], "--cache") == 0 && i + 1 < argc) {
+      sscanf(argv[++i], "%d", &cache_mb);
+    } else if (strcmp(argv[i], "-c") == 0 && i + 1 < argc) {
+      cache_dir = argv[++i];
+      mkdir(cache_dir, 0777);
+    } else if (is_number(argv[i]) && n_numbers < 2 && !n_paths) {
+      sscanf(argv[i], "%d", n_numbers++ ? &o.aa : &o.scale);
+    } else {
+      paths[n_paths++] = argv[i];
+    }
+  }
+  if (n_threads < 1) n_threads = 1;
+
+  if (serving) {
+    if (n_paths != 1) {
+      fprintf(stderr, "svg: --serve takes one document\n");
+      return 1;
+    }
+    o.threads = n_threads;
+    serve(&o, paths[0], socket_path, (size_t)cache_mb << 20);
+    free(paths);
+    return 0;
+  }
+
+  if (o.preview && n_paths) {
+    fprintf(stderr, "svg: --preview reads from stdin\n");
+    return 1;
+  }
+
+  job_list l = {0};
+  for (int i = 0; i < n_paths; ++i) add_jobs(&l, paths[i], dir);
+  free(paths);
+
+  if (!n_paths) {
+    o.threads = n_threads;
+    render(&o, stdin, stdout);
+    if (run_stats.enabled) print_stats(stderr, "svg", NULL);
+  } else {
+    run_batch(&o, &l, n_threads);
+  }
+  return 0;
+}
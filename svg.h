@@ -0,0 +1,32 @@
+#include <stdio.h>
+
+typedef struct raster_options {
+  int scale;
+  int aa;
+  int debug;
+  int fixed;
+  int pipeline;
+  int width, height;
+  int crop_x, crop_y, crop_w, crop_h;
+  int threads;
+  float gamma;
+  int index;
+  const char *preview;
+  float tolerance;
+} raster_options;
+
+void compile_svg(FILE *in, FILE *out);
+void interpret_commands(FILE *in, FILE *out, int scale);
+
+// interpret's --simplify bound and --batch flag.
+extern float simplify;
+extern int batched;
+void rasterize_polygons(raster_options *o, FILE *in, FILE *out);
+
+typedef struct polygon_set polygon_set;
+
+polygon_set *load_polygons(FILE *in);
+int polygon_set_size(polygon_set *s, int *width, int *height);
+void render_region(raster_options *o, polygon_set *s, float scale, float x,
+                   float y, FILE *out);
+void free_polygons(polygon_set *s);